@@ -67,6 +67,9 @@
  */
 #define PADDR_TO_KVADDR(paddr) ((paddr)+MIPS_KSEG0)
 
+/* The reverse, for kseg0 addresses handed out by alloc_kpages. */
+#define KVADDR_TO_PADDR(vaddr) ((vaddr)-MIPS_KSEG0)
+
 /*
  * The top of user space. (Actually, the address immediately above the
  * last valid user address.)
@@ -102,17 +105,59 @@ void ram_bootstrap(void);
 paddr_t ram_stealmem(unsigned long npages);
 void ram_getsize(paddr_t *lo, paddr_t *hi);
 
+/*
+ * Page table entries.
+ *
+ * A PTE is laid out like the TLBLO register (see <mips/tlb.h>): the
+ * physical frame in the top 20 bits, then the write-enable ("dirty")
+ * and valid bits in the same positions, so a resident entry can be
+ * handed to the TLB without translation. The low byte is ignored by
+ * the hardware and holds software-only flags.
+ *
+ * A page that has been paged out has PTE_VALID clear and PTE_SWAPPED
+ * set, and the frame bits hold its swap slot instead.
+ *
+ * TLB misses on user pages are refilled straight from the PTE by the
+ * UTLB handler in locore, without a pin. PTE_NOREFILL sends them to
+ * vm_fault instead, which pins the frame and clears it. Anyone taking
+ * away or changing a mapping that the owner may be using on another
+ * cpu must therefore change the PTE, or set PTE_NOREFILL, before
+ * revoking the TLB entry; then a miss in between waits for the pin.
+ */
+typedef uint32_t pte_t;
+
+#define PTE_FRAME     0xfffff000	/* physical frame (TLBLO_PPAGE) */
+#define PTE_WRITE     0x00000400	/* writes allowed (TLBLO_DIRTY) */
+#define PTE_VALID     0x00000200	/* frame is resident (TLBLO_VALID) */
+#define PTE_COW       0x00000001	/* frame is shared copy-on-write */
+#define PTE_SWAPPED   0x00000002	/* page is out on swap */
+#define PTE_MODIFIED  0x00000004	/* written (shared file pages only) */
+#define PTE_NOREFILL  0x00000008	/* TLB misses go to vm_fault */
+
+#define PTE_SWAPSLOT(pte)   ((unsigned)(pte) >> 12)
+#define PTE_SWAPPTE(slot)   (((pte_t)(slot) << 12) | PTE_SWAPPED)
+#define PTE_SWAPSLOT_MAX    0x100000
+
+/*
+ * Per-address-space TLB state: the address space ID it was last given
+ * (PID in the low bits, allocation generation above), and the cpu it
+ * was last activated on. Zero-initialize; see vm_tlb_activate.
+ */
+struct tlbasid {
+	uint32_t ta_asid;
+	unsigned ta_cpu;
+};
+
 /*
  * TLB shootdown bits.
  *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * Entries are named the way the TLB itself knows them, by page and
+ * address space ID (a tlbasid's ta_asid).
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	struct addrspace *ts_addrspace;
+	uint32_t ts_asid;
 	vaddr_t ts_vaddr;
 };
 
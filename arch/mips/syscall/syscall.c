@@ -27,6 +27,7 @@
  * SUCH DAMAGE.
  */
 #include "opt-A2.h"
+#include "opt-dumbvm.h"
 
 
 #include <types.h>
@@ -37,6 +38,7 @@
 #include <mips/trapframe.h>
 #include <thread.h>
 #include <current.h>
+#include <copyinout.h>
 #include <syscall.h>
 
 /*
@@ -151,6 +153,39 @@ syscall(struct trapframe *tf)
                                &retval);
                 break;
 #endif //OPTA2
+#if !OPT_DUMBVM
+	    case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
+		break;
+
+	    case SYS_mmap:
+	    {
+		/* fd and the 64-bit offset are on the user stack. */
+		int fd;
+		off_t offset;
+
+		err = copyin((const_userptr_t)(tf->tf_sp + 16), &fd,
+			     sizeof(fd));
+		if (err == 0) {
+			err = copyin((const_userptr_t)(tf->tf_sp + 24),
+				     &offset, sizeof(offset));
+		}
+		if (err == 0) {
+			err = sys_mmap((userptr_t)tf->tf_a0, tf->tf_a1,
+				       tf->tf_a2, tf->tf_a3, fd, offset,
+				       (vaddr_t *)&retval);
+		}
+		break;
+	    }
+
+	    case SYS_munmap:
+		err = sys_munmap(tf->tf_a0, tf->tf_a1);
+		break;
+
+	    case SYS_fsync:
+		err = sys_fsync(tf->tf_a0);
+		break;
+#endif
 	default:
 	  kprintf("Unknown syscall %d\n", callno);
 	  err = ENOSYS;
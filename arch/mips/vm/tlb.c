@@ -0,0 +1,486 @@
+#include "opt-dumbvm.h"
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <platform/maxcpus.h>
+#include <mips/tlb.h>
+#include <vm.h>
+#include <uw-vmstats.h>
+
+/*
+ * MIPS TLB management for the VM system.
+ *
+ * PTEs are already in TLBLO format (see <machine/vm.h>), so loading
+ * one is just a matter of masking off the software bits.
+ *
+ * When the TLB is full, a victim is chosen according to vm_tlbpolicy:
+ *
+ *    TLBPOLICY_RR     - round robin: each cpu keeps a hand that walks
+ *                       the TLB slots in order.
+ *    TLBPOLICY_RANDOM - let the processor pick a slot with tlbwr.
+ *    TLBPOLICY_CLOCK  - like round robin, but a slot loaded since the
+ *                       hand last passed it gets a second chance.
+ *
+ * The per-cpu state is indexed by cpu number, like cpustacks[].
+ *
+ * Address spaces are told apart in the TLB by the 6-bit PID field of
+ * entryhi, so switching processes doesn't require a flush. ASIDs are
+ * handed out from a global counter; the bits above the PID field count
+ * generations. When the 63 usable ASIDs run out (0 is left for address
+ * spaces that have never been activated, and dumbvm), a new generation
+ * starts and every cpu flushes its TLB the next time it activates an
+ * address space. An address space whose ASID is from an older
+ * generation gets a fresh one at that point.
+ *
+ * OS/161 user processes are single-threaded, so an address space is
+ * live on only one cpu at a time. When it moves to another cpu it is
+ * also given a fresh ASID, because the entries it left behind on its
+ * previous cpu may be stale by the time it comes back there.
+ *
+ * Pages are paged out by whatever thread needs the memory, which may
+ * be on any cpu, so vm_tlb_revoke can't assume the address space is
+ * here. Because of the rule above, only one cpu can have usable
+ * entries for it: the one it was last activated on. If that's another
+ * cpu and the address space is still live there, we send it the pages
+ * by IPI and wait for it to acknowledge; if it isn't, we just abandon
+ * the entries by forcing a fresh ASID on its next activation. Either
+ * way no other cpu is bothered. Callers gather pages into a tlbbatch
+ * so that a munmap, fork, or clock sweep costs one IPI per
+ * TLBSHOOTDOWN_MAX pages rather than one per page.
+ *
+ * Every TLB operation clobbers entryhi, and the processor matches
+ * against the PID in entryhi, so the functions below put the current
+ * PID back before reenabling interrupts.
+ *
+ * Most misses never get here: the UTLB handler in locore walks the
+ * page table in cpupagetables[] for this cpu and loads the PTE itself
+ * with tlbwr, so the replacement policy only governs entries loaded
+ * by vm_fault. Activating an address space points that slot at its
+ * page table (unless vm_tlbfastrefill is off); deactivating it, or
+ * running dumbvm, leaves it NULL and every miss goes the slow way.
+ * The handler has no time for the vmstats lock, so it just bumps a
+ * per-cpu count in cpufastrefills[], and vm_tlb_foldstats adds what's
+ * new there into the vmstats when they're wanted.
+ */
+
+#define PTE_TLBLO_MASK  (TLBLO_PPAGE | TLBLO_DIRTY | TLBLO_VALID)
+
+int vm_tlbpolicy = TLBPOLICY_RR;
+bool vm_tlbfastrefill = true;
+
+/* Read by mips_utlb_handler, indexed like cpustacks[] */
+struct pagetable *cpupagetables[MAXCPUS];
+
+/* Bumped by mips_utlb_handler; each only by its own cpu */
+uint32_t cpufastrefills[MAXCPUS];
+static uint32_t tlb_refillsfolded[MAXCPUS];	/* tlb_statlock */
+static struct spinlock tlb_statlock = SPINLOCK_INITIALIZER;
+
+static unsigned tlb_hand[MAXCPUS];
+static uint32_t tlb_recent[MAXCPUS][NUM_TLB / 32];
+
+#define RECENT_ISSET(c, i) ((tlb_recent[c][(i)/32] & (1U << ((i)%32))) != 0)
+#define RECENT_SET(c, i)   (tlb_recent[c][(i)/32] |= (1U << ((i)%32)))
+#define RECENT_CLEAR(c, i) (tlb_recent[c][(i)/32] &= ~(1U << ((i)%32)))
+
+#define ASID_COUNT  ((TLBHI_PID >> TLBHI_PIDSHIFT) + 1)
+#define ASID_PID(a) (((a) & (ASID_COUNT - 1)) << TLBHI_PIDSHIFT)
+#define ASID_GEN(a) ((a) & ~(uint32_t)(ASID_COUNT - 1))
+
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asid_generation = ASID_COUNT;	/* protected by asid_lock */
+static uint32_t asid_next = 1;			/* protected by asid_lock */
+
+static uint32_t tlb_asidgen[MAXCPUS];	/* generation of this cpu's TLB */
+static uint32_t tlb_curpid[MAXCPUS];	/* entryhi PID now in use */
+static struct tlbasid *tlb_curta[MAXCPUS]; /* active here; asid_lock */
+static struct cpu *tlb_cpus[MAXCPUS];	/* by number, once activated */
+
+/* ta_cpu value that forces a new ASID on next activation */
+#define TA_NOCPU  MAXCPUS
+
+/*
+ * Invalidate every entry on this cpu. Interrupts must be off.
+ */
+static
+void
+tlb_flushlocal(unsigned c)
+{
+	int i;
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	for (i=0; i<NUM_TLB/32; i++) {
+		tlb_recent[c][i] = 0;
+	}
+	tlb_setpid(tlb_curpid[c]);
+}
+
+void
+vm_tlb_flush(void)
+{
+	int spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	tlb_flushlocal(curcpu->c_number);
+	splx(spl);
+}
+
+void
+vm_tlb_activate(struct tlbasid *ta, struct pagetable *pt)
+{
+	unsigned c;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_number;
+
+	spinlock_acquire(&asid_lock);
+	if (ASID_GEN(ta->ta_asid) != asid_generation || ta->ta_cpu != c) {
+		if (asid_next == ASID_COUNT) {
+			asid_generation += ASID_COUNT;
+			asid_next = 1;
+		}
+		ta->ta_asid = asid_generation | asid_next++;
+		ta->ta_cpu = c;
+	}
+	tlb_curta[c] = ta;
+	tlb_cpus[c] = curcpu->c_self;
+	tlb_curpid[c] = ASID_PID(ta->ta_asid);
+	cpupagetables[c] = vm_tlbfastrefill ? pt : NULL;
+	if (tlb_asidgen[c] != asid_generation) {
+		/* ASIDs were recycled; whatever is here may now alias. */
+		tlb_asidgen[c] = asid_generation;
+		spinlock_release(&asid_lock);
+		tlb_flushlocal(c);
+	}
+	else {
+		spinlock_release(&asid_lock);
+		tlb_setpid(tlb_curpid[c]);
+	}
+
+	splx(spl);
+}
+
+void
+vm_tlb_deactivate(void)
+{
+	unsigned c;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_number;
+	cpupagetables[c] = NULL;
+	spinlock_acquire(&asid_lock);
+	tlb_curta[c] = NULL;
+	spinlock_release(&asid_lock);
+	splx(spl);
+}
+
+void
+vm_tlb_destroy(struct tlbasid *ta)
+{
+	unsigned i;
+
+	spinlock_acquire(&asid_lock);
+	for (i=0; i<MAXCPUS; i++) {
+		if (tlb_curta[i] == ta) {
+			tlb_curta[i] = NULL;
+			cpupagetables[i] = NULL;
+		}
+	}
+	spinlock_release(&asid_lock);
+}
+
+/*
+ * Return the index of an invalid TLB slot, or -1 if all are in use.
+ */
+static
+int
+tlb_findfree(void)
+{
+	uint32_t ehi, elo;
+	int i;
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&ehi, &elo, i);
+		if ((elo & TLBLO_VALID) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Choose a slot to evict on this cpu, or -1 to let the hardware
+ * choose.
+ */
+static
+int
+tlb_victim(void)
+{
+	unsigned c, i;
+
+	c = curcpu->c_number;
+
+	switch (vm_tlbpolicy) {
+	    case TLBPOLICY_RANDOM:
+		return -1;
+	    case TLBPOLICY_CLOCK:
+		/* At most one full lap clears every bit. */
+		while (RECENT_ISSET(c, tlb_hand[c])) {
+			RECENT_CLEAR(c, tlb_hand[c]);
+			tlb_hand[c] = (tlb_hand[c] + 1) % NUM_TLB;
+		}
+		break;
+	    default:
+		break;
+	}
+
+	i = tlb_hand[c];
+	tlb_hand[c] = (i + 1) % NUM_TLB;
+	return i;
+}
+
+void
+vm_tlb_load(vaddr_t vaddr, pte_t pte)
+{
+	uint32_t ehi, elo;
+	unsigned c;
+	int i, spl;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+	KASSERT(pte & PTE_VALID);
+
+	elo = pte & PTE_TLBLO_MASK;
+
+	spl = splhigh();
+	c = curcpu->c_number;
+	ehi = vaddr | tlb_curpid[c];
+
+	/*
+	 * Replace an existing entry for this page if there is one
+	 * (e.g. upgrading a read-only entry after copy-on-write);
+	 * that isn't a TLB miss and isn't counted as one.
+	 */
+	i = tlb_probe(ehi, 0);
+	if (i < 0) {
+		i = tlb_findfree();
+		if (i >= 0) {
+			vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+		}
+		else {
+			i = tlb_victim();
+			vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+		}
+	}
+
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", vaddr, pte & TLBLO_PPAGE);
+	if (i < 0) {
+		tlb_random(ehi, elo);
+	}
+	else {
+		tlb_write(ehi, elo, i);
+		RECENT_SET(c, (unsigned)i);
+	}
+	tlb_setpid(tlb_curpid[c]);
+
+	splx(spl);
+}
+
+void
+vm_tlb_preload(vaddr_t vaddr, pte_t pte)
+{
+	uint32_t ehi, elo;
+	unsigned c;
+	int i, spl;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+	KASSERT(pte & PTE_VALID);
+
+	elo = pte & PTE_TLBLO_MASK;
+
+	spl = splhigh();
+	c = curcpu->c_number;
+	ehi = vaddr | tlb_curpid[c];
+
+	/* No miss happened, so nothing here is counted. */
+	if (tlb_probe(ehi, 0) < 0) {
+		i = tlb_findfree();
+		if (i < 0) {
+			i = tlb_victim();
+		}
+		if (i < 0) {
+			tlb_random(ehi, elo);
+		}
+		else {
+			/* Not used yet; the clock policy may take it first. */
+			tlb_write(ehi, elo, i);
+			RECENT_CLEAR(c, (unsigned)i);
+		}
+		tlb_setpid(tlb_curpid[c]);
+	}
+
+	splx(spl);
+}
+
+void
+vm_tlb_invalidate(vaddr_t vaddr)
+{
+	unsigned c;
+	int i, spl;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	spl = splhigh();
+	c = curcpu->c_number;
+	i = tlb_probe(vaddr | tlb_curpid[c], 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		vmstats_inc(VMSTAT_TLB_INVALIDATE);
+	}
+	tlb_setpid(tlb_curpid[c]);
+	splx(spl);
+}
+
+/*
+ * Invalidate this cpu's entry, if any, for VADDR under the address
+ * space ID ASID. Interrupts must be off.
+ */
+static
+void
+tlb_invalidateasid(unsigned c, uint32_t asid, vaddr_t vaddr)
+{
+	int slot;
+
+	slot = tlb_probe(vaddr | ASID_PID(asid), 0);
+	if (slot >= 0) {
+		tlb_write(TLBHI_INVALID(slot), TLBLO_INVALID(), slot);
+		vmstats_inc(VMSTAT_TLB_INVALIDATE);
+	}
+	tlb_setpid(tlb_curpid[c]);
+}
+
+/*
+ * Only one cpu ever needs telling, because usable entries for an
+ * address space can only be on ta_cpu: vm_tlb_activate hands out a
+ * fresh ASID whenever the address space lands on a different cpu, so
+ * whatever it left behind elsewhere is tagged with an ASID that is no
+ * longer its own and can never be matched again. An old ASID only
+ * comes back when the generation rolls over, and every cpu flushes
+ * its TLB before using the new generation. The same argument lets
+ * as_destroy free frames without revoking anything: nothing will
+ * activate that address space again, so its ASID is never current
+ * again anywhere, and entries left under it can't be matched.
+ */
+void
+vm_tlb_revokebatch(struct tlbbatch *tb)
+{
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	struct tlbasid *ta = tb->tb_ta;
+	struct cpu *target;
+	unsigned c, i;
+	int spl;
+
+	KASSERT(tb->tb_n <= TLBSHOOTDOWN_MAX);
+	if (tb->tb_n == 0) {
+		return;
+	}
+
+	spl = splhigh();
+	c = curcpu->c_number;
+
+	/*
+	 * Shoot down on ta_cpu only if the address space is still
+	 * active there; otherwise it's cheaper to retire the ASID.
+	 */
+	spinlock_acquire(&asid_lock);
+	target = NULL;
+	if (ta->ta_cpu == c) {
+		for (i=0; i<tb->tb_n; i++) {
+			tlb_invalidateasid(c, ta->ta_asid, tb->tb_vaddrs[i]);
+		}
+	}
+	else if (ta->ta_cpu < MAXCPUS && tlb_curta[ta->ta_cpu] == ta) {
+		target = tlb_cpus[ta->ta_cpu];
+		for (i=0; i<tb->tb_n; i++) {
+			ts[i].ts_asid = ta->ta_asid;
+			ts[i].ts_vaddr = tb->tb_vaddrs[i];
+		}
+	}
+	else {
+		/* Abandon whatever it left on its old cpu. */
+		ta->ta_cpu = TA_NOCPU;
+	}
+	spinlock_release(&asid_lock);
+	splx(spl);
+
+	/*
+	 * If it moves off the target meanwhile, it gets a fresh ASID
+	 * wherever it lands, and the shootdown still clears the old
+	 * entries out of the target.
+	 */
+	if (target != NULL) {
+		ipi_tlbshootdown_wait(target, ts, tb->tb_n);
+	}
+	tb->tb_n = 0;
+}
+
+void
+vm_tlb_revoke(struct tlbasid *ta, vaddr_t vaddr)
+{
+	struct tlbbatch tb;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	tlbbatch_init(&tb, ta);
+	(void)tlbbatch_add(&tb, vaddr);
+	vm_tlb_revokebatch(&tb);
+}
+
+#if !OPT_DUMBVM
+
+void
+vm_tlbshootdown_all(void)
+{
+	vm_tlb_flush();
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	int spl;
+
+	spl = splhigh();
+	tlb_invalidateasid(curcpu->c_number, ts->ts_asid, ts->ts_vaddr);
+	splx(spl);
+}
+
+#endif /* !OPT_DUMBVM */
+
+void
+vm_tlb_foldstats(void)
+{
+	unsigned i;
+	uint32_t count, n;
+
+	spinlock_acquire(&tlb_statlock);
+	for (i=0; i<MAXCPUS; i++) {
+		/* A single word, so a racing refill is just counted later. */
+		count = cpufastrefills[i];
+		n = count - tlb_refillsfolded[i];
+		tlb_refillsfolded[i] = count;
+		if (n > 0) {
+			vmstats_add(VMSTAT_TLB_FAULT, n);
+			vmstats_add(VMSTAT_TLB_FAULT_REPLACE, n);
+			vmstats_add(VMSTAT_TLB_RELOAD, n);
+		}
+	}
+	spinlock_release(&tlb_statlock);
+}
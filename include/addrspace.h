@@ -36,8 +36,11 @@
 
 
 #include <vm.h>
+#include "opt-dumbvm.h"
 
 struct vnode;
+struct pagetable;
+struct sharedtext;
 
 
 /* 
@@ -47,6 +50,7 @@ struct vnode;
  * You write this.
  */
 
+#if OPT_DUMBVM
 struct addrspace {
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
@@ -56,6 +60,68 @@ struct addrspace {
   size_t as_npages2;
   paddr_t as_stackpbase;
 };
+#else
+
+/*
+ * A region is a page-aligned range of virtual addresses the process
+ * may touch. Pages inside a region are only given physical memory
+ * when they are first faulted on (see vm_fault).
+ *
+ * A region loaded from an executable also remembers where its
+ * contents come from: the RG_FILESZ bytes starting at virtual address
+ * RG_FILEVA are read from RG_VNODE at RG_OFFSET as each page is first
+ * touched. Everything else in the region starts out zero. Read-only
+ * segments are instead shared by every process running the program,
+ * through RG_TEXT (see <sharedtext.h>).
+ *
+ * Regions made by mmap are marked RG_MMAP. A private file mapping is
+ * backed the same way as a writable segment. A shared one goes through
+ * the file's shared object like a read-only segment, except that
+ * RG_TEXTBASE, the object's key for the first page, is the file offset
+ * rather than RG_BASE, and writes go to the shared frames.
+ *
+ * The permissions are enforced as far as the MIPS allows: pages in a
+ * region without RG_WRITE are mapped read-only. Reading and executing
+ * can't be told apart.
+ */
+struct region {
+	vaddr_t rg_base;		/* first address, page aligned */
+	size_t rg_npages;		/* length in pages */
+	int rg_flags;			/* RG_* permissions */
+	struct vnode *rg_vnode;		/* backing file, or NULL */
+	vaddr_t rg_fileva;		/* where the file data starts */
+	off_t rg_offset;		/* ...and its offset in the file */
+	size_t rg_filesz;		/* ...and its length */
+	struct sharedtext *rg_text;	/* shared pages, or NULL */
+	vaddr_t rg_textbase;		/* ...and their key at rg_base */
+	struct region *rg_next;
+};
+
+#define RG_READ    0x4
+#define RG_WRITE   0x2
+#define RG_EXEC    0x1
+#define RG_MMAP    0x8		/* made by mmap */
+#define RG_SHARED  0x10		/* MAP_SHARED; writes reach the file */
+
+/*
+ * Under our VM the user stack is a region of up to VM_STACKPAGES pages
+ * (4M) reserved below USERSTACK. Like everything else it is populated
+ * only as it is touched, so it costs a page or two for most programs.
+ * Below it is a guard page that no other region may use, so running
+ * off the end faults instead of scribbling on the heap or a mapping.
+ */
+#define VM_STACKPAGES    1024
+#define VM_GUARDPAGES    1
+
+struct addrspace {
+	struct region *as_regions;	/* list of valid regions */
+	struct region *as_heap;		/* heap region, once loaded */
+	vaddr_t as_brk;			/* current break (end of heap) */
+	struct pagetable *as_pt;	/* virtual page -> PTE */
+	struct tlbasid as_tlb;		/* TLB address space ID */
+};
+
+#endif /* OPT_DUMBVM */
 
 /*
  * Functions in addrspace.c:
@@ -82,11 +148,18 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_file - arrange for part of a region to be paged in from
+ *                a file on demand, rather than being zero-filled. If
+ *                the region is read-only, its pages are shared with
+ *                other processes mapping the same file data.
+ *                (Not in dumbvm.)
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
  *    as_complete_load - this is called when loading from an executable
- *                is complete.
+ *                is complete. Sets up an empty heap after the last
+ *                region loaded.
  *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
@@ -104,10 +177,47 @@ int               as_define_region(struct addrspace *as,
                                    int readable, 
                                    int writeable,
                                    int executable);
+#if !OPT_DUMBVM
+int               as_define_file(struct addrspace *as, struct vnode *v,
+                                 off_t offset, vaddr_t vaddr,
+                                 size_t memsize, size_t filesize);
+#endif
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
+#if !OPT_DUMBVM
+/*
+ *    as_findregion - return the region containing VADDR, or NULL.
+ *
+ *    as_sbrk   - move the end of the heap by AMOUNT bytes, handing back
+ *                the old end in OLDBRK. Pages freed by shrinking it are
+ *                released at once. AS must be the current address
+ *                space.
+ *
+ *    as_mmap   - map LEN bytes of V starting at OFFSET in AS, with RG_*
+ *                permissions FLAGS, handing back the address chosen in
+ *                RET. That's HINT (rounded down to a page) if the range
+ *                there is free, and otherwise somewhere that is. If
+ *                SHARED, writes go to the file and are seen by everyone
+ *                else mapping it shared.
+ *
+ *    as_munmap - remove whatever pages of as_mmap mappings lie in the
+ *                LEN bytes at page-aligned VADDR, writing back shared
+ *                pages first. A mapping only partly in the range keeps
+ *                the rest, split in two if need be. Fails with EINVAL,
+ *                unmapping nothing, if the range touches anything else.
+ *                AS must be the current address space.
+ */
+struct region    *as_findregion(struct addrspace *as, vaddr_t vaddr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbrk);
+int               as_mmap(struct addrspace *as, struct vnode *v,
+                          off_t offset, size_t len, vaddr_t hint, int flags,
+                          bool shared, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+#endif
+
 
 /*
  * Functions in loadelf.c
@@ -0,0 +1,163 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical page frame management.
+ *
+ * The coremap has one entry for every physical page frame in the
+ * machine, indexed by physical page number. Frames below the first
+ * page handed back by ram_getsize() (exception vectors, the kernel
+ * image, and anything grabbed with ram_stealmem during early boot)
+ * are permanently marked fixed; everything above that is managed.
+ *
+ * Functions:
+ *     coremap_bootstrap - take over physical memory from ram.c. Must be
+ *                         called once, from vm_bootstrap.
+ *     coremap_alloc     - allocate NPAGES physically contiguous frames.
+ *                         Returns 0 if no run of that length is free.
+ *     coremap_alloc_upage - allocate a single frame to back the user
+ *                         page VADDR in AS, with a reference count of 1.
+ *                         If no frame is free, one is paged out to swap.
+ *                         The frame is returned pinned (see below).
+ *                         Returns 0 if memory and swap are exhausted.
+ *     coremap_free      - release a run previously returned by
+ *                         coremap_alloc, given its first frame.
+ *     coremap_incref    - add a reference to a user frame (another page
+ *                         table now maps it).
+ *     coremap_decref    - drop a reference to a user frame; the frame
+ *                         is freed when the last one goes away, along
+ *                         with the caller's pin if it has one.
+ *     coremap_refcount  - return the number of references to a user
+ *                         frame. This is only a snapshot: a count of 1
+ *                         is stable for the sole owner, anything larger
+ *                         may drop at any time.
+ *     coremap_alloc_zupage - the same, but the frame comes zero-filled,
+ *                         from the pool if possible.
+ *     coremap_freecount - return the number of free frames, counting
+ *                         the zero pool.
+ *     coremap_pin       - pin the frame *PTE refers to, waiting if
+ *                         someone else has it pinned. Returns false if
+ *                         *PTE no longer maps a resident frame by then.
+ *                         If the PTE is the frame's only mapping, AS and
+ *                         VADDR are recorded as its owner.
+ *     coremap_preloadpin - the same, for preloading a TLB entry the
+ *                         owner hasn't asked for: returns false rather
+ *                         than wait if the frame is already pinned, or
+ *                         if *PTE has PTE_NOREFILL set, and doesn't
+ *                         count as a use of the frame.
+ *     coremap_unpin     - release a pin.
+ *     coremap_printstats - print the buddy free lists and per-order
+ *                         allocation counts.
+ *     coremap_zeroidle  - zero one free frame for the pool, if it is
+ *                         short. Returns false if there was nothing to
+ *                         do. Called by idle cpus, via vm_idle.
+ *     coremap_setclean  - note that pinned user frame PADDR, just read
+ *                         in from swap SLOT, is identical to the copy
+ *                         there, which the frame now owns.
+ *     coremap_setdirty  - note that pinned user frame PADDR is about to
+ *                         be written, releasing its swap copy if any.
+ *     coremap_startdaemon - start the page daemon. Called from
+ *                         vm_bootstrap once there is swap to page to.
+ *     coremap_ismerged  - return true if user frame PADDR was shared by
+ *                         same-page merging, and still is.
+ *     coremap_setksm    - turn same-page merging on or off. It is off
+ *                         to begin with.
+ *     coremap_getksm    - return whether same-page merging is on.
+ *
+ * A pinned ("busy") frame is never chosen for page-out, and a frame
+ * being paged out is pinned for the duration. Anything that examines
+ * or changes a user frame or the PTE mapping it, other than through
+ * the TLB, must hold the pin, and must load any TLB entry for it
+ * before letting go. Page-out invalidates TLB entries before changing
+ * the PTE, so once a frame is pinned its PTE stays put.
+ *
+ * The page daemon pages out frames that haven't been used lately
+ * whenever free memory drops below a low-water mark, until it is back
+ * above a high-water mark (see coremap.c).
+ *
+ * Private pages with identical contents may also be merged into one
+ * frame shared copy-on-write, if same-page merging is turned on.
+ *
+ * Only frames with a single mapping and a known owner are paged out;
+ * pages shared copy-on-write stay resident until the sharing ends and
+ * the remaining mapping is faulted on again.
+ *
+ * Free frames are kept in a binary buddy system: blocks of 2^k frames
+ * aligned (relative to the first managed frame) on their size, one
+ * free list per order k, merged with their buddy whenever both halves
+ * are free. A run of N frames comes from the smallest block that
+ * holds it, with the excess handed straight back, so contiguous
+ * allocations stay cheap and keep finding room.
+ *
+ * Single frames are allocated from and freed to a small per-cpu cache
+ * (CME_CPU; see struct cpu), which is refilled and emptied a batch at
+ * a time, so the common case doesn't touch the global lock.
+ *
+ * Idle cpus keep a small pool of free frames zeroed in advance
+ * (CME_ZERO), so that zero-fill faults don't have to. Pooled frames go
+ * back to being plain free frames if memory gets tight.
+ *
+ * Before coremap_bootstrap is called, coremap_alloc falls back on
+ * ram_stealmem so that kmalloc works during early boot; such pages are
+ * never reclaimed, and freeing them is silently ignored.
+ */
+
+#include <vm.h>
+#include "opt-dumbvm.h"
+
+/* Frame states */
+#define CME_FREE	0	/* available for allocation */
+#define CME_FIXED	1	/* kernel image / early boot; never freed */
+#define CME_KERNEL	2	/* allocated by coremap_alloc */
+#define CME_USER	3	/* backs a user page */
+#define CME_ZERO	4	/* free, zero-filled, in the zero pool */
+#define CME_CPU		5	/* free, in a cpu's frame cache */
+
+/* Buddy orders: free blocks of 1 to 2^(COREMAP_NORDERS-1) frames */
+#define COREMAP_NORDERS		11
+
+/* Number of frames idle cpus keep zeroed */
+#define COREMAP_ZEROPOOL	32
+
+struct addrspace;
+
+struct coremap_entry {
+	uint8_t cme_state;	/* one of the CME_* states above */
+	uint8_t cme_busy:1;	/* pinned; see coremap_pin */
+	uint8_t cme_recent:1;	/* used since the clock hand last passed */
+	uint8_t cme_clean:1;	/* user frame matches cme_swapslot */
+	uint8_t cme_merged:1;	/* shared by same-page merging */
+	uint16_t cme_refcount;	/* page tables mapping a CME_USER frame */
+	uint32_t cme_npages;	/* run or free block length; first frame only */
+	struct addrspace *cme_as;	/* owner of a CME_USER frame, or NULL */
+	vaddr_t cme_vaddr;		/* ...and where it's mapped there */
+	unsigned cme_next;	/* free list links for a free block, */
+	unsigned cme_prev;	/* ...by frame number; 0 ends the list */
+	unsigned cme_swapslot;	/* swap copy of a clean frame */
+	uint32_t cme_hash;	/* contents when last scanned for merging */
+};
+
+void coremap_bootstrap(void);
+paddr_t coremap_alloc(unsigned long npages);
+paddr_t coremap_alloc_upage(struct addrspace *as, vaddr_t vaddr);
+paddr_t coremap_alloc_zupage(struct addrspace *as, vaddr_t vaddr);
+void coremap_free(paddr_t paddr);
+void coremap_incref(paddr_t paddr);
+void coremap_decref(paddr_t paddr);
+unsigned coremap_refcount(paddr_t paddr);
+unsigned coremap_freecount(void);
+bool coremap_pin(pte_t *pte, struct addrspace *as, vaddr_t vaddr);
+bool coremap_preloadpin(pte_t *pte, struct addrspace *as, vaddr_t vaddr);
+void coremap_unpin(paddr_t paddr);
+void coremap_printstats(void);
+bool coremap_zeroidle(void);
+#if !OPT_DUMBVM
+void coremap_setclean(paddr_t paddr, unsigned slot);
+void coremap_setdirty(paddr_t paddr);
+void coremap_startdaemon(void);
+bool coremap_ismerged(paddr_t paddr);
+void coremap_setksm(bool on);
+bool coremap_getksm(void);
+#endif
+
+#endif /* _COREMAP_H_ */
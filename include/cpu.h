@@ -46,6 +46,13 @@
  * a pointer with a fixed address and a per-cpu mapping in the MMU.
  */
 
+/* Size of each cpu's cache of free physical frames */
+#define CPU_FRAMECACHE  16
+
+/* kmalloc size classes, and blocks each cpu caches for each one */
+#define CPU_KMALLOCSIZES  15
+#define CPU_KMAGSIZE      16
+
 struct cpu {
 	/*
 	 * Fixed after allocation.
@@ -82,11 +89,43 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * c_shootdown_seq is bumped each time the queued shootdowns
+	 * have been done, so senders can wait for theirs.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_seq;
 	struct spinlock c_ipi_lock;
+
+	/*
+	 * Normally accessed only by this cpu, but other cpus may empty
+	 * the cache when memory is short.
+	 * Protected by the frame cache lock.
+	 *
+	 * A few free physical frames are kept here so that most page
+	 * allocations and frees don't need the global coremap lock;
+	 * see coremap.c.
+	 */
+	unsigned c_freeframes[CPU_FRAMECACHE];	/* frame numbers */
+	unsigned c_nfreeframes;
+	struct spinlock c_framelock;
+
+	/*
+	 * Normally accessed only by this cpu, but other cpus may empty
+	 * the magazines when memory is short.
+	 * Protected by the magazine lock.
+	 *
+	 * Free kmalloc blocks of each size class, so that most small
+	 * allocations and frees don't need the global kmalloc lock;
+	 * see kmalloc.c.
+	 */
+	void *c_kmag[CPU_KMALLOCSIZES][CPU_KMAGSIZE];
+	unsigned c_nkmag[CPU_KMALLOCSIZES];
+	unsigned c_kmallocs[CPU_KMALLOCSIZES];	/* blocks handed out */
+	uint64_t c_kslack[CPU_KMALLOCSIZES];	/* ...and bytes unasked for */
+	struct spinlock c_kmalloclock;
 };
 
 #define TLBSHOOTDOWN_ALL  (-1)
@@ -109,6 +148,11 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Call FUNC on every cpu, including this one.
+ */
+void cpu_foreach(void (*func)(struct cpu *c, void *data), void *data);
+
 /*
  * Return a string describing the CPU type.
  */
@@ -152,6 +196,9 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_wait sends N shootdowns with a single IPI, and
+ * waits until the target has done them. It must be called with
+ * interrupts on, or two cpus shooting at each other would deadlock.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +213,8 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_wait(struct cpu *target,
+			   const struct tlbshootdown *mappings, unsigned n);
 
 void interprocessor_interrupt(void);
 
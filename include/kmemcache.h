@@ -0,0 +1,62 @@
+#ifndef _KMEMCACHE_H_
+#define _KMEMCACHE_H_
+
+/*
+ * Object caches for frequently created kernel structures.
+ *
+ * A cache hands out objects of one fixed size, packed into whole pages
+ * ("slabs") with no rounding up to a kmalloc size class. If the cache
+ * has a constructor, every object is constructed once, when its slab
+ * is set up, and freed objects go back to the cache still constructed:
+ * whatever the constructor set up (spinlocks, list nodes, buffers)
+ * must be left as it found it by the time the object is freed, and is
+ * there, ready to use, when the object is handed out again. The
+ * destructor is only run when a slab is given back to the system.
+ *
+ * Caches are defined statically with KMEM_CACHE_INITIALIZER, so they
+ * work from the very start of boot:
+ *
+ *     static struct kmem_cache thread_cache =
+ *         KMEM_CACHE_INITIALIZER("thread", sizeof(struct thread),
+ *                                thread_ctor, thread_dtor);
+ *
+ * Functions:
+ *     kmem_cache_alloc - return a constructed object from CACHE, or NULL
+ *                        if out of memory (or a constructor failed).
+ *     kmem_cache_free  - return OBJ, which must have come from CACHE,
+ *                        to it. Slabs left entirely free beyond the
+ *                        first are given back to the system.
+ *     kmem_cache_printstats - print slab and object counts for every
+ *                        cache that has been used.
+ *
+ * The constructor returns 0 or an error code; the destructor may be
+ * NULL if there is nothing to undo.
+ */
+
+#include <spinlock.h>
+
+struct kmem_slab;	/* Private to kmemcache.c */
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;				/* object size */
+	int (*kc_ctor)(void *obj);		/* or NULL */
+	void (*kc_dtor)(void *obj);		/* or NULL */
+	struct spinlock kc_lock;
+	struct kmem_slab *kc_partial;		/* slabs with free objects */
+	unsigned kc_nslabs;			/* slabs in all */
+	unsigned kc_nempty;			/* ...of which entirely free */
+	unsigned kc_inuse;			/* objects handed out */
+	struct kmem_cache *kc_next;		/* list of caches in use */
+	bool kc_listed;				/* ...and whether we're on it */
+};
+
+#define KMEM_CACHE_INITIALIZER(name, size, ctor, dtor) \
+	{ (name), (size), (ctor), (dtor), SPINLOCK_INITIALIZER, \
+	  NULL, 0, 0, 0, NULL, false }
+
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+void kmem_cache_printstats(void);
+
+#endif /* _KMEMCACHE_H_ */
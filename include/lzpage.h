@@ -0,0 +1,32 @@
+#ifndef _LZPAGE_H_
+#define _LZPAGE_H_
+
+/*
+ * A small, fast LZ77 compressor for pages going to compressed swap.
+ *
+ * The format is a series of sequences, each a token byte, then a run
+ * of literal bytes, then a match: a 2-byte little-endian distance back
+ * into the output and a length. The token's high nibble is the literal
+ * count and its low nibble the match length less LZ_MINMATCH; a nibble
+ * of 15 is continued in following bytes, each added on, until one is
+ * less than 255. The last sequence stops after its literals.
+ *
+ * Functions:
+ *     lz_compress   - compress the LEN bytes at SRC into at most MAX
+ *                     bytes at DST, using TABLE (LZ_TABLESIZE entries)
+ *                     as scratch. Returns the compressed length, or 0
+ *                     if it doesn't fit. LEN must be under 64k.
+ *     lz_decompress - expand the SRCLEN bytes at SRC into exactly
+ *                     DSTLEN bytes at DST. Returns EINVAL if the input
+ *                     is damaged or the wrong length.
+ */
+
+#define LZ_HASHBITS   10
+#define LZ_TABLESIZE  (1 << LZ_HASHBITS)
+#define LZ_MINMATCH   4
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t max,
+		   uint16_t *table);
+int lz_decompress(const void *src, size_t srclen, void *dst, size_t dstlen);
+
+#endif /* _LZPAGE_H_ */
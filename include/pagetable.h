@@ -0,0 +1,51 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page tables.
+ *
+ * The top 10 bits of a user virtual address select an entry in the
+ * directory; each directory entry points to a page-sized table of
+ * 1024 PTEs indexed by the next 10 bits. Second-level tables are only
+ * allocated for 4M chunks of the address space that actually contain
+ * a mapping, so a small process costs one directory page plus one
+ * table per segment.
+ *
+ * PTE layout is machine-dependent; see <machine/vm.h>.
+ *
+ * The MIPS UTLB handler (arch/mips/locore) walks this structure
+ * directly on a TLB miss, so the layout here is fixed: pt_dir must
+ * stay first, and both levels must stay 10 bits.
+ *
+ * Functions:
+ *     pt_create  - allocate an empty page table. Returns NULL on error.
+ *     pt_destroy - free the table structure. The caller must already
+ *                  have released whatever the PTEs refer to.
+ *     pt_lookup  - return a pointer to the PTE for VADDR. If there is no
+ *                  second-level table for it, allocate one when CREATE
+ *                  is set (returning NULL if that fails), and return
+ *                  NULL otherwise.
+ *     pt_walk    - call FUNC on every nonzero PTE, in address order.
+ *                  Stops early and returns FUNC's result if FUNC
+ *                  returns nonzero.
+ */
+
+#include <vm.h>
+
+#define PT_L1_ENTRIES  1024
+#define PT_L2_ENTRIES  1024
+
+#define PT_L1_INDEX(va)  (((va) >> 22) & (PT_L1_ENTRIES - 1))
+#define PT_L2_INDEX(va)  (((va) >> 12) & (PT_L2_ENTRIES - 1))
+
+struct pagetable {
+	pte_t *pt_dir[PT_L1_ENTRIES];
+};
+
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+int pt_walk(struct pagetable *pt,
+	    int (*func)(void *data, vaddr_t vaddr, pte_t *pte), void *data);
+
+#endif /* _PAGETABLE_H_ */
@@ -0,0 +1,79 @@
+#ifndef _SHAREDTEXT_H_
+#define _SHAREDTEXT_H_
+
+/*
+ * Shared file pages: read-only program segments and MAP_SHARED
+ * mappings.
+ *
+ * Every process running a given executable maps its read-only
+ * segments (text and read-only data) to the same frames. Each such
+ * segment has one sharedtext object, found by the vnode it comes from
+ * and where the segment sits in the file and in memory; every region
+ * that maps the segment holds a reference to it. The object keeps a
+ * page table of the frames read in so far, and holds a reference to
+ * each of those frames; a process mapping a page holds another.
+ *
+ * The page table is indexed by a page-aligned key standing in for a
+ * virtual address. For a program segment the key is the user virtual
+ * address itself. A file mapped MAP_SHARED gets one object for the
+ * whole file (st_file set), with FILEVA and OFFSET zero, so the key is
+ * the file offset. A region records the key of its first page; see
+ * struct region.
+ *
+ * Pages of a shared file mapping are mapped read-only until the first
+ * write through any mapping, which sets PTE_MODIFIED in the object's
+ * table. Modified pages are written back to the file when the
+ * mapping's owner asks (munmap, fsync) and when the last mapping goes
+ * away. They stay marked modified afterwards, since some process may
+ * still be able to write them.
+ *
+ * The frames have no single owner, so they are never paged out. They
+ * go away when the last region using the object does.
+ *
+ * Functions:
+ *     sharedtext_bootstrap - set up. Called from vm_bootstrap.
+ *     sharedtext_get  - return the object for the segment of FILESZ
+ *                       bytes at OFFSET in V, loaded at FILEVA, creating
+ *                       it if needed, with a new reference. Returns
+ *                       NULL if out of memory.
+ *     sharedtext_getfile - return the whole-file object for V, as
+ *                       sharedtext_get does.
+ *     sharedtext_incref - add a reference.
+ *     sharedtext_put  - drop a reference; the last one releases the
+ *                       frames and the object's reference to V, after
+ *                       writing back modified pages of a file object.
+ *     sharedtext_sync - write back the modified pages of a file object.
+ *     sharedtext_syncfile - the same, for the file object of V if it
+ *                       has one.
+ *
+ * st_lock must be held while examining or changing st_pt.
+ */
+
+#include <vm.h>
+
+struct vnode;
+struct lock;
+struct pagetable;
+
+struct sharedtext {
+	struct vnode *st_vnode;		/* file the segment comes from */
+	off_t st_offset;		/* segment's place in the file */
+	vaddr_t st_fileva;		/* ...and in memory */
+	size_t st_filesz;		/* ...and its length */
+	bool st_file;			/* whole-file object for mmap */
+	unsigned st_refcount;		/* regions mapping it */
+	struct lock *st_lock;		/* protects st_pt */
+	struct pagetable *st_pt;	/* frames read in so far */
+	struct sharedtext *st_next;	/* list of all segments */
+};
+
+void sharedtext_bootstrap(void);
+struct sharedtext *sharedtext_get(struct vnode *v, off_t offset,
+				  vaddr_t fileva, size_t filesz);
+struct sharedtext *sharedtext_getfile(struct vnode *v);
+void sharedtext_incref(struct sharedtext *st);
+void sharedtext_put(struct sharedtext *st);
+int sharedtext_sync(struct sharedtext *st);
+int sharedtext_syncfile(struct vnode *v);
+
+#endif /* _SHAREDTEXT_H_ */
@@ -74,6 +74,8 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ * held		Check if any CPU holds the lock. Only good for assertions
+ *		about locks nobody else should be able to touch.
  */
 
 void spinlock_init(struct spinlock *lk);
@@ -83,6 +85,7 @@ void spinlock_acquire(struct spinlock *lk);
 void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
+bool spinlock_held(struct spinlock *lk);
 
 
 #endif /* _SPINLOCK_H_ */
@@ -0,0 +1,53 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * Pages evicted from memory are written to a raw disk, one page per
+ * slot, with a bitmap recording which slots are in use. A page that is
+ * out on swap is recorded in its PTE as PTE_SWAPPED plus the slot
+ * number (see <machine/vm.h>).
+ *
+ * Pages that compress well are kept in a pool of RAM instead, as long
+ * as there is room, and only go to the disk when there isn't. They
+ * still use up a slot, which is what the PTE refers to.
+ *
+ * Functions:
+ *     swap_bootstrap - open the swap disk. Called from vm_bootstrap; if
+ *                      there isn't one, the system runs without swap.
+ *     swap_enabled   - return true if there is a swap disk.
+ *     swap_pageout   - write frame PADDR, which holds the page VADDR of
+ *                      AS, to a free slot and point the page's PTE at
+ *                      the slot. The frame must be pinned. Fails with
+ *                      ENOSPC if swap is full.
+ *     swap_pageclean - point the PTE for frame PADDR, the page VADDR of
+ *                      AS, back at SLOT, which still holds an identical
+ *                      copy, without writing anything. The frame must be
+ *                      pinned.
+ *     swap_pagein    - read the page in SLOT into frame PADDR. The slot
+ *                      stays allocated. Sets *FROMDISK to say whether
+ *                      the page came off the disk or out of the
+ *                      compressed pool.
+ *     swap_discard   - release SLOT.
+ *     swap_printstats - print slot usage and how well the compressed
+ *                      pool is doing.
+ */
+
+#include <vm.h>
+
+/* The swap disk. */
+#define SWAP_DEVICE  "lhd1raw:"
+
+struct addrspace;
+
+void swap_bootstrap(void);
+bool swap_enabled(void);
+int swap_pageout(struct addrspace *as, vaddr_t vaddr, paddr_t paddr);
+void swap_pageclean(struct addrspace *as, vaddr_t vaddr, paddr_t paddr,
+		    unsigned slot);
+int swap_pagein(unsigned slot, paddr_t paddr, bool *fromdisk);
+void swap_discard(unsigned slot);
+void swap_printstats(void);
+
+#endif /* _SWAP_H_ */
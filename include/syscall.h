@@ -30,6 +30,7 @@
 #ifndef _SYSCALL_H_
 #define _SYSCALL_H_
 #include "opt-A2.h"
+#include "opt-dumbvm.h"
 
 struct trapframe; /* from <machine/trapframe.h> */
 
@@ -60,6 +61,14 @@ int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 
 int sys_fork(struct trapframe *tf, pid_t* retval);
 
+#if !OPT_DUMBVM
+int sys_sbrk(intptr_t amount, vaddr_t *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, vaddr_t *retval);
+int sys_munmap(vaddr_t addr, size_t len);
+int sys_fsync(int fd);
+#endif
+
 
 #if OPT_A2
 
@@ -36,7 +36,14 @@
 #define VMSTAT_ELF_FILE_READ          (7)
 #define VMSTAT_SWAP_FILE_READ         (8)
 #define VMSTAT_SWAP_FILE_WRITE        (9)
-#define VMSTAT_COUNT                 (10)
+#define VMSTAT_PAGES_SCANNED         (10)
+#define VMSTAT_PAGES_RECLAIMED       (11)
+#define VMSTAT_PAGES_WRITTEN         (12)
+#define VMSTAT_KSM_MERGED            (13)
+#define VMSTAT_KSM_SPLIT             (14)
+#define VMSTAT_ZSWAP_STORE           (15)
+#define VMSTAT_ZSWAP_HIT             (16)
+#define VMSTAT_COUNT                 (17)
 
 /* ----------------------------------------------------------------------- */
 
@@ -52,6 +59,9 @@ void _vmstats_init(void);                    /* atomicity must be ensured elsewh
 void vmstats_inc(unsigned int index);    /* uses locking */
 void _vmstats_inc(unsigned int index);   /* atomicity must be ensured elsewhere */
 
+/* Add COUNT to the specified count, for events tallied elsewhere first */
+void vmstats_add(unsigned int index, unsigned int count);  /* uses locking */
+
 /* Print the statistics: assumes that at least vmstats_init has been called */
 void vmstats_print(void);                    /* Does NOT use locking */
 
@@ -39,6 +39,8 @@
 
 #include <machine/vm.h>
 
+struct pagetable;
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
@@ -55,9 +57,104 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
-/* TLB shootdown handling called from interprocessor_interrupt */
+/*
+ * Background work for a cpu with nothing to run, called from
+ * thread_switch with interrupts on (the cpu is marked idle, so they
+ * don't switch away). Returns false if there was nothing to do, in
+ * which case the caller should actually idle.
+ */
+bool vm_idle(void);
+
+/*
+ * TLB shootdown handling called from interprocessor_interrupt. The
+ * real VM system's are in the machine-dependent TLB code.
+ */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/*
+ * TLB management. These live in the machine-dependent code and only
+ * affect the current cpu.
+ *
+ *    vm_tlb_flush      - invalidate every entry.
+ *    vm_tlb_activate   - switch to the address space ID in TA,
+ *                        assigning a new one if needed, and let the
+ *                        fast refill path use page table PT. Entries
+ *                        of other address spaces stay in the TLB.
+ *    vm_tlb_deactivate - stop the fast refill path using the page
+ *                        table; every miss goes to vm_fault.
+ *    vm_tlb_destroy    - forget TA, whose address space is going away,
+ *                        so that revocations never look for it again.
+ *    vm_tlb_load       - enter a translation for VADDR described by
+ *                        PTE, evicting another entry according to
+ *                        vm_tlbpolicy if the TLB is full.
+ *    vm_tlb_preload    - the same, for a page that didn't miss: leaves
+ *                        any entry already there alone, and isn't
+ *                        counted in the TLB fault vmstats.
+ *    vm_tlb_invalidate - drop any translation for VADDR.
+ *    vm_tlb_revoke     - make sure no cpu can use a translation for
+ *                        VADDR in the address space TA belongs to. This
+ *                        one isn't local: if that address space is live
+ *                        on another cpu, it is shot down there, and we
+ *                        wait for it. Must be called with interrupts on.
+ *    vm_tlb_revokebatch - the same for every page in TB, at the cost of
+ *                        at most one IPI, after which TB is empty.
+ *    vm_tlb_foldstats  - add the misses every cpu's fast refill path
+ *                        has handled since last time into the vmstats.
+ *
+ * A tlbbatch collects pages of one address space whose translations
+ * are to be revoked together. Callers add to it with tlbbatch_add,
+ * which returns true when the batch is full and must be revoked.
+ */
+struct tlbbatch {
+	struct tlbasid *tb_ta;
+	unsigned tb_n;
+	vaddr_t tb_vaddrs[TLBSHOOTDOWN_MAX];
+};
+
+#define tlbbatch_init(tb, ta) ((tb)->tb_ta = (ta), (tb)->tb_n = 0)
+#define tlbbatch_add(tb, va) \
+	((tb)->tb_vaddrs[(tb)->tb_n++] = (va), \
+	 (tb)->tb_n == TLBSHOOTDOWN_MAX)
+
+void vm_tlb_flush(void);
+void vm_tlb_activate(struct tlbasid *ta, struct pagetable *pt);
+void vm_tlb_deactivate(void);
+void vm_tlb_destroy(struct tlbasid *ta);
+void vm_tlb_load(vaddr_t vaddr, pte_t pte);
+void vm_tlb_preload(vaddr_t vaddr, pte_t pte);
+void vm_tlb_invalidate(vaddr_t vaddr);
+void vm_tlb_revoke(struct tlbasid *ta, vaddr_t vaddr);
+void vm_tlb_revokebatch(struct tlbbatch *tb);
+void vm_tlb_foldstats(void);
+
+/* TLB replacement policies, for vm_tlbpolicy */
+#define TLBPOLICY_RR       0	/* round robin (default) */
+#define TLBPOLICY_RANDOM   1	/* hardware random slot */
+#define TLBPOLICY_CLOCK    2	/* round robin with second chance */
+
+extern int vm_tlbpolicy;
+
+/*
+ * Fast TLB refill: when on, misses on resident pages of the current
+ * address space are handled by the UTLB exception handler straight
+ * from the page table, into a random slot, and never reach vm_fault.
+ * The handler only counts them; vm_tlb_foldstats adds them into the
+ * vmstats as reloads that replaced an entry. Changes take effect at
+ * the next activation.
+ */
+extern bool vm_tlbfastrefill;
+
+/*
+ * Fault-around: on a TLB miss, vm_fault also loads entries for the
+ * other resident pages of the same region in the aligned window of
+ * vm_faultaround pages (at most VM_FAULTAROUND_MAX) around the fault.
+ * 1 turns it off. Not in dumbvm.
+ */
+#define VM_FAULTAROUND_DEFAULT  4
+#define VM_FAULTAROUND_MAX      16
+
+extern int vm_faultaround;
+
 
 #endif /* _VM_H_ */
@@ -41,10 +41,15 @@
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
+#include <vm.h>
+#include <coremap.h>
+#include <swap.h>
+#include <uw-vmstats.h>
 #include <test.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -411,6 +416,147 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_coremapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremap_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_tlb_foldstats();
+	vmstats_print();
+
+	return 0;
+}
+
+/*
+ * Command for choosing the TLB replacement policy.
+ */
+static
+int
+cmd_tlbpolicy(int nargs, char **args)
+{
+	static const char *names[] = { "rr", "random", "clock" };
+	int i;
+
+	if (nargs == 1) {
+		kprintf("TLB replacement policy: %s\n", names[vm_tlbpolicy]);
+		return 0;
+	}
+	if (nargs == 2) {
+		for (i=0; i<3; i++) {
+			if (!strcmp(args[1], names[i])) {
+				vm_tlbpolicy = i;
+				return 0;
+			}
+		}
+	}
+	kprintf("Usage: tlbp [rr | random | clock]\n");
+	return EINVAL;
+}
+
+/*
+ * Command for turning the fast TLB refill path on and off.
+ */
+static
+int
+cmd_tlbrefill(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprintf("Fast TLB refill: %s\n",
+			vm_tlbfastrefill ? "on" : "off");
+		return 0;
+	}
+	if (nargs == 2) {
+		if (!strcmp(args[1], "on")) {
+			vm_tlbfastrefill = true;
+			return 0;
+		}
+		if (!strcmp(args[1], "off")) {
+			vm_tlbfastrefill = false;
+			return 0;
+		}
+	}
+	kprintf("Usage: tlbf [on | off]\n");
+	return EINVAL;
+}
+
+#if !OPT_DUMBVM
+/*
+ * Command for setting the fault-around window.
+ */
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	int width;
+
+	if (nargs == 1) {
+		kprintf("Fault-around window: %d pages\n", vm_faultaround);
+		return 0;
+	}
+	if (nargs == 2) {
+		width = atoi(args[1]);
+		if (width >= 1 && width <= VM_FAULTAROUND_MAX) {
+			vm_faultaround = width;
+			return 0;
+		}
+	}
+	kprintf("Usage: fa [1-%d]\n", VM_FAULTAROUND_MAX);
+	return EINVAL;
+}
+
+/*
+ * Command for turning same-page merging on and off.
+ */
+static
+int
+cmd_ksm(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprintf("Same-page merging: %s\n",
+			coremap_getksm() ? "on" : "off");
+		return 0;
+	}
+	if (nargs == 2) {
+		if (!strcmp(args[1], "on")) {
+			coremap_setksm(true);
+			return 0;
+		}
+		if (!strcmp(args[1], "off")) {
+			coremap_setksm(false);
+			return 0;
+		}
+	}
+	kprintf("Usage: ksm [on | off]\n");
+	return EINVAL;
+}
+
+static
+int
+cmd_swapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	swap_printstats();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -520,6 +666,15 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[cm] Physical memory stats          ",
+	"[vs] VM stats                       ",
+	"[tlbp] TLB replacement policy       ",
+	"[tlbf] Fast TLB refill              ",
+#if !OPT_DUMBVM
+	"[fa] Fault-around window            ",
+	"[ksm] Same-page merging             ",
+	"[sw] Swap stats                     ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -576,6 +731,15 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "cm",         cmd_coremapstats },
+	{ "vs",         cmd_vmstats },
+	{ "tlbp",       cmd_tlbpolicy },
+	{ "tlbf",       cmd_tlbrefill },
+#if !OPT_DUMBVM
+	{ "fa",         cmd_faultaround },
+	{ "ksm",        cmd_ksm },
+	{ "sw",         cmd_swapstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
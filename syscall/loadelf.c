@@ -42,14 +42,17 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Outside dumbvm, executables are demand-paged: instead of being read
+ * in here, each segment is attached to its region with as_define_file
+ * and its pages are read from the file when they are first touched.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
  * linker). And you'd have to write a dynamic linker...
  */
 
+#include "opt-dumbvm.h"
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
@@ -74,6 +77,7 @@
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
  */
+#if OPT_DUMBVM
 static
 int
 load_segment(struct addrspace *as, struct vnode *v,
@@ -144,6 +148,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 	
 	return result;
 }
+#endif /* OPT_DUMBVM */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -259,7 +264,8 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	}
 
 	/*
-	 * Now actually load each segment.
+	 * Now actually load each segment. (Or, with demand paging,
+	 * say where to load it from later.)
 	 */
 
 	for (i=0; i<eh.e_phnum; i++) {
@@ -288,9 +294,14 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_DUMBVM
 		result = load_segment(as, v, ph.p_offset, ph.p_vaddr, 
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
+#else
+		result = as_define_file(as, v, ph.p_offset, ph.p_vaddr,
+					ph.p_memsz, ph.p_filesz);
+#endif
 		if (result) {
 			return result;
 		}
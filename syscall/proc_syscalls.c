@@ -55,8 +55,6 @@ void sys__exit(int exitcode) {
 #if OPT_A2
 int sys_fork(struct trapframe *tf, pid_t *retval)
 {
-	int s;
-	s = splhigh();
 	struct proc *p = curproc; // get the current process
 	struct trapframe *child_trapframe; // define a trapframe pointer 
 
@@ -72,19 +70,21 @@ int sys_fork(struct trapframe *tf, pid_t *retval)
 	struct proc *child_proc = proc_create_runprogram(p->p_name); // create a new process with the same 		//name
 	if(child_proc == NULL)
 	{
+		kfree(child_trapframe);
 		*retval = -1;
 		return ENOMEM;
 	}
 	
 
 	int result = as_copy(p->p_addrspace, &child_proc->p_addrspace);// copy the address space from the parent to the child process
-	/*lot of problems can happen here but the most common problem is the os running out of memory to give to the vm, which causes the vm to not be able to return any pages to ram_stealmem which causes as_prepare_load not to return an addresspace to as_copy which final fails to create or copy the address space from the parent to child in sys_fork here. */
+	/* as_copy can fail if memory and swap are both exhausted; the parent just gets the error. */
 
 	//KASSERT(child_proc->p_addrspace != NULL);
 	if(result) {
-		panic("\nNo address space defined %d (sys_fork)this probably means the os ran out of memory.\n",result);
+		proc_destroy(child_proc);
+		kfree(child_trapframe);
 		*retval = -1;
-		return ENOMEM;
+		return result;
 	}
 	
 
@@ -106,7 +106,6 @@ int sys_fork(struct trapframe *tf, pid_t *retval)
 	
 	int err = thread_fork(curthread->t_name, child_proc, (void*)enter_forked_process, child_trapframe, (unsigned long)ft); // fork a new thread for the child process with the same name as the parents threads pass the child_tf
 	//and pass the enter forked process.
-	splx(s);
 	if (err){
 		*retval = -1;
 		return err;
@@ -0,0 +1,169 @@
+#include "opt-A2.h"
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/limits.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <syscall.h>
+#include <current.h>
+#include <proc.h>
+#include <thread.h>
+#include <vnode.h>
+#include <file.h>
+#include <addrspace.h>
+#include <sharedtext.h>
+
+/*
+ * Memory management system calls.
+ */
+
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	KASSERT(as != NULL);
+
+	return as_sbrk(as, amount, retval);
+}
+
+/*
+ * Look up file descriptor FD, handing back its vnode with a new
+ * reference in RET and the flags it was opened with in FLAGS.
+ */
+static
+int
+vm_getfile(int fd, struct vnode **ret, int *flags)
+{
+#if OPT_A2
+	struct filetable *ft = curthread->t_filetable;
+	struct filetable_entry *fte;
+
+	if (fd < 0 || fd >= __OPEN_MAX) {
+		return EBADF;
+	}
+
+	spinlock_acquire(&ft->filetable_spinlock);
+	fte = ft->filetable_entries[fd];
+	if (fte == NULL || fte->filetable_vnode == NULL) {
+		spinlock_release(&ft->filetable_spinlock);
+		return EBADF;
+	}
+	VOP_INCREF(fte->filetable_vnode);
+	*ret = fte->filetable_vnode;
+	*flags = fte->filetable_flags;
+	spinlock_release(&ft->filetable_spinlock);
+	return 0;
+#else
+	(void)fd;
+	(void)ret;
+	(void)flags;
+	return EBADF;
+#endif
+}
+
+/*
+ * ADDR is only a hint, and taken if nothing is mapped there; there is
+ * no MAP_FIXED.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, vaddr_t *retval)
+{
+	struct addrspace *as;
+	struct vnode *v;
+	bool shared;
+	int rgflags, how, result;
+
+	if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+		return EINVAL;
+	}
+	shared = flags == MAP_SHARED;
+	if (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) {
+		return EINVAL;
+	}
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	/* Offsets have to fit in a shared object's page table. */
+	if (offset + len > USERSPACETOP) {
+		return EINVAL;
+	}
+
+	result = vm_getfile(fd, &v, &how);
+	if (result) {
+		return result;
+	}
+	how &= O_ACCMODE;
+	if (how == O_WRONLY ||
+	    (shared && (prot & PROT_WRITE) && how != O_RDWR)) {
+		VOP_DECREF(v);
+		return EACCES;
+	}
+
+	result = VOP_MMAP(v);
+	if (result) {
+		VOP_DECREF(v);
+		return result;
+	}
+
+	rgflags = 0;
+	if (prot & PROT_READ) {
+		rgflags |= RG_READ;
+	}
+	if (prot & PROT_WRITE) {
+		rgflags |= RG_WRITE;
+	}
+	if (prot & PROT_EXEC) {
+		rgflags |= RG_EXEC;
+	}
+
+	as = curproc_getas();
+	KASSERT(as != NULL);
+
+	result = as_mmap(as, v, offset, len, (vaddr_t)addr, rgflags, shared,
+			 retval);
+	VOP_DECREF(v);
+	return result;
+}
+
+int
+sys_munmap(vaddr_t addr, size_t len)
+{
+	struct addrspace *as;
+
+	if (addr % PAGE_SIZE != 0 || len == 0) {
+		return EINVAL;
+	}
+
+	as = curproc_getas();
+	KASSERT(as != NULL);
+
+	return as_munmap(as, addr, len);
+}
+
+/*
+ * Write back anything written through shared mappings of the file,
+ * then flush the file itself.
+ */
+int
+sys_fsync(int fd)
+{
+	struct vnode *v;
+	int how, result;
+
+	result = vm_getfile(fd, &v, &how);
+	if (result) {
+		return result;
+	}
+
+	result = sharedtext_syncfile(v);
+	if (result == 0) {
+		result = VOP_FSYNC(v);
+	}
+	VOP_DECREF(v);
+	return result;
+}
@@ -211,9 +211,10 @@ vmstats_thread(void *junk, unsigned long num)
             vmstats_inc(j);
             break;
 
-          /* VMSTAT_TLB_FAULT = VMSTAT_TLB_RELOAD + VMSTAT_PAGE_FAULT_DISK + VMSTAT_SWAP_FILE_ZERO */
+          /* VMSTAT_TLB_FAULT = VMSTAT_TLB_RELOAD + VMSTAT_PAGE_FAULT_DISK + VMSTAT_SWAP_FILE_ZERO
+           *                    + VMSTAT_ZSWAP_HIT */
           case VMSTAT_PAGE_FAULT_ZERO:
-            if (i % 2 == 0) {
+            if (i % 4 == 0) {
                vmstats_inc(j);
             }
             break;
@@ -243,6 +244,50 @@ vmstats_thread(void *junk, unsigned long num)
             }
             break;
 
+          /* VMSTAT_PAGES_WRITTEN <= VMSTAT_PAGES_RECLAIMED <= VMSTAT_PAGES_SCANNED */
+          case VMSTAT_PAGES_SCANNED:
+            vmstats_inc(j);
+            break;
+
+          case VMSTAT_PAGES_RECLAIMED:
+            if (i % 2 == 0) {
+               vmstats_inc(j);
+            }
+            break;
+
+          case VMSTAT_PAGES_WRITTEN:
+            if (i % 4 == 0) {
+               vmstats_inc(j);
+            }
+            break;
+
+          /* VMSTAT_KSM_SPLIT <= VMSTAT_KSM_MERGED */
+          case VMSTAT_KSM_MERGED:
+            if (i % 2 == 0) {
+               vmstats_inc(j);
+            }
+            break;
+
+          case VMSTAT_KSM_SPLIT:
+            if (i % 4 == 0) {
+               vmstats_inc(j);
+            }
+            break;
+
+          /* Pages put in the pool aren't counted as swapfile writes */
+          case VMSTAT_ZSWAP_STORE:
+            if (i % 16 == 0) {
+               vmstats_inc(j);
+            }
+            break;
+
+          /* Faults served from the pool: the rest of VMSTAT_TLB_FAULT */
+          case VMSTAT_ZSWAP_HIT:
+            if (i % 4 == 2) {
+               vmstats_inc(j);
+            }
+            break;
+
           default:
             kprintf("Unknown stat %d\n", j);
             break;
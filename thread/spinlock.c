@@ -139,3 +139,12 @@ spinlock_do_i_hold(struct spinlock *lk)
 	/* Assume we can read lk_holder atomically enough for this to work */
 	return (lk->lk_holder == curcpu->c_self);
 }
+
+/*
+ * Check if any cpu holds the lock.
+ */
+bool
+spinlock_held(struct spinlock *lk)
+{
+	return (lk->lk_holder != NULL);
+}
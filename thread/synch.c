@@ -40,12 +40,40 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <kmemcache.h>
 
 
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
 
+/*
+ * Semaphores come from an object cache, and keep their spinlock set
+ * up while free.
+ */
+static
+int
+sem_ctor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_init(&sem->sem_lock);
+	return 0;
+}
+
+static
+void
+sem_dtor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_cleanup(&sem->sem_lock);
+}
+
+static struct kmem_cache sem_cache =
+	KMEM_CACHE_INITIALIZER("semaphore", sizeof(struct semaphore),
+			       sem_ctor, sem_dtor);
+
 struct semaphore *
 sem_create(const char *name, int initial_count)
 {
@@ -53,25 +81,24 @@ sem_create(const char *name, int initial_count)
 
         KASSERT(initial_count >= 0);
 
-        sem = kmalloc(sizeof(struct semaphore));
+        sem = kmem_cache_alloc(&sem_cache);
         if (sem == NULL) {
                 return NULL;
         }
 
         sem->sem_name = kstrdup(name);
         if (sem->sem_name == NULL) {
-                kfree(sem);
+                kmem_cache_free(&sem_cache, sem);
                 return NULL;
         }
 
 	sem->sem_wchan = wchan_create(sem->sem_name);
 	if (sem->sem_wchan == NULL) {
 		kfree(sem->sem_name);
-		kfree(sem);
+		kmem_cache_free(&sem_cache, sem);
 		return NULL;
 	}
 
-	spinlock_init(&sem->sem_lock);
         sem->sem_count = initial_count;
 
         return sem;
@@ -82,11 +109,11 @@ sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
-	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
+	/* wchan_destroy will assert if anyone's waiting on it */
+	KASSERT(!spinlock_held(&sem->sem_lock));
 	wchan_destroy(sem->sem_wchan);
         kfree(sem->sem_name);
-        kfree(sem);
+        kmem_cache_free(&sem_cache, sem);
 }
 
 void 
@@ -149,19 +176,46 @@ V(struct semaphore *sem)
 //
 // Lock.
 #if OPT_A1
+
+/*
+ * Locks, like semaphores, keep their spinlock set up while free.
+ */
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_init(&lock->lk_lock);
+	return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->lk_lock);
+}
+
+static struct kmem_cache lock_cache =
+	KMEM_CACHE_INITIALIZER("lock", sizeof(struct lock),
+			       lock_ctor, lock_dtor);
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = kmem_cache_alloc(&lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                kmem_cache_free(&lock_cache, lock);
                 return NULL;
         }
         
@@ -171,11 +225,10 @@ lock_create(const char *name)
 
 	if(lock->lk_wchan ==NULL){
 		kfree(lock->lk_name);
-		kfree(lock);
+		kmem_cache_free(&lock_cache, lock);
+		return NULL;
 	}
 
-	spinlock_init(&lock->lk_lock);	
-
 		
 		lock->held = 0;
 		lock->holder = NULL;
@@ -188,11 +241,10 @@ lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
 	KASSERT(curthread->t_in_interrupt == false);
-	spinlock_cleanup(&lock->lk_lock);
+	KASSERT(!spinlock_held(&lock->lk_lock));
 	wchan_destroy(lock->lk_wchan);
         kfree(lock->lk_name);
-	kfree(lock->holder);
-        kfree(lock);
+        kmem_cache_free(&lock_cache, lock);
 }
 
 void
@@ -248,27 +300,29 @@ lock_do_i_hold(struct lock *lock){
 //
 // CV
 
+static struct kmem_cache cv_cache =
+	KMEM_CACHE_INITIALIZER("cv", sizeof(struct cv), NULL, NULL);
 
 struct cv *
 cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(struct cv));
+        cv = kmem_cache_alloc(&cv_cache);
         if (cv == NULL) {
                 return NULL;
         }
 
         cv->cv_name = kstrdup(name);
         if (cv->cv_name==NULL) {
-                kfree(cv);
+                kmem_cache_free(&cv_cache, cv);
                 return NULL;
         }
 
 	cv->cv_wchan = wchan_create(cv->cv_name);
 	if(cv->cv_wchan == NULL){
 		kfree(cv->cv_name);		
-		kfree(cv);
+		kmem_cache_free(&cv_cache, cv);
 		return NULL;
 	}
         
@@ -285,7 +339,7 @@ cv_destroy(struct cv *cv)
         // add stuff here as needed
         wchan_destroy(cv->cv_wchan);
         kfree(cv->cv_name);
-        kfree(cv);
+        kmem_cache_free(&cv_cache, cv);
 }
 
 void
@@ -50,6 +50,7 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <kmemcache.h>
 
 #include "opt-synchprobs.h"
 
@@ -64,6 +65,24 @@ struct wchan {
 	struct spinlock wc_lock;	/* lock for mutual exclusion */
 };
 
+/*
+ * Threads and wait channels come from object caches. A free thread
+ * keeps its list node set up; a free wait channel keeps its lock and
+ * its (empty) list. Stacks are not kept: nothing would give them back
+ * when memory runs short.
+ */
+static int thread_ctor(void *obj);
+static void thread_dtor(void *obj);
+static int wchan_ctor(void *obj);
+static void wchan_dtor(void *obj);
+
+static struct kmem_cache thread_cache =
+	KMEM_CACHE_INITIALIZER("thread", sizeof(struct thread),
+			       thread_ctor, thread_dtor);
+static struct kmem_cache wchan_cache =
+	KMEM_CACHE_INITIALIZER("wchan", sizeof(struct wchan),
+			       wchan_ctor, wchan_dtor);
+
 /* Master array of CPUs. */
 DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
@@ -111,6 +130,28 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Object cache constructor and destructor for threads.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_init(&thread->t_listnode, thread);
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_cleanup(&thread->t_listnode);
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -123,14 +164,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(&thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(&thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -138,7 +179,6 @@ thread_create(const char *name)
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
@@ -169,6 +209,7 @@ struct cpu *
 cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
+	unsigned i;
 	int result;
 	char namebuf[16];
 
@@ -190,8 +231,19 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_seq = 0;
 	spinlock_init(&c->c_ipi_lock);
 
+	c->c_nfreeframes = 0;
+	spinlock_init(&c->c_framelock);
+
+	for (i=0; i<CPU_KMALLOCSIZES; i++) {
+		c->c_nkmag[i] = 0;
+		c->c_kmallocs[i] = 0;
+		c->c_kslack[i] = 0;
+	}
+	spinlock_init(&c->c_kmalloclock);
+
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
@@ -230,6 +282,19 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Call FUNC on every cpu.
+ */
+void
+cpu_foreach(void (*func)(struct cpu *c, void *data), void *data)
+{
+	unsigned i;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		func(cpuarray_get(&allcpus, i), data);
+	}
+}
+
 /*
  * Destroy a thread.
  *
@@ -254,15 +319,18 @@ thread_destroy(struct thread *thread)
 	KASSERT(thread->t_proc == NULL);
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
+		thread->t_stack = NULL;
 	}
-	threadlistnode_cleanup(&thread->t_listnode);
+	KASSERT(thread->t_listnode.tln_next == NULL);
+	KASSERT(thread->t_listnode.tln_prev == NULL);
 	thread_machdep_cleanup(&thread->t_machdep);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
+	/* The list node stays set up with the object; see thread_ctor. */
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(&thread_cache, thread);
 }
 
 /*
@@ -551,6 +619,7 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc)
 {
 	struct thread *cur, *next;
+	bool idlework;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -634,11 +703,27 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
+	idlework = true;
 	do {
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (idlework) {
+				/*
+				 * Do something useful first, if there's
+				 * anything, with interrupts on so that it
+				 * doesn't hold them off. Either way we look
+				 * at the run queue again before waiting,
+				 * in case they woke someone up.
+				 */
+				spl0();
+				idlework = vm_idle();
+				splhigh();
+			}
+			else {
+				cpu_idle();
+				idlework = true;
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -966,6 +1051,30 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+/*
+ * Object cache constructor and destructor for wait channels.
+ */
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+	return 0;
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_cleanup(&wc->wc_lock);
+	threadlist_cleanup(&wc->wc_threads);
+}
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -979,26 +1088,24 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(&wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 	return wc;
 }
 
 /*
- * Destroy a wait channel. Must be empty and unlocked.
- * (The corresponding cleanup functions require this.)
+ * Destroy a wait channel. Must be empty and unlocked, since it goes
+ * back to the cache as it is (see wchan_ctor).
  */
 void
 wchan_destroy(struct wchan *wc)
 {
-	spinlock_cleanup(&wc->wc_lock);
-	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	KASSERT(!spinlock_held(&wc->wc_lock));
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	kmem_cache_free(&wchan_cache, wc);
 }
 
 /*
@@ -1143,14 +1250,22 @@ ipi_broadcast(int code)
 	}
 }
 
+/*
+ * Queue one shootdown for TARGET, whose IPI lock must be held. If the
+ * queue is full, or has already overflowed, the whole TLB is flushed.
+ */
+static
 void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+ipi_queueshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
 	int n;
 
-	spinlock_acquire(&target->c_ipi_lock);
+	KASSERT(spinlock_do_i_hold(&target->c_ipi_lock));
 
 	n = target->c_numshootdown;
+	if (n == TLBSHOOTDOWN_ALL) {
+		return;
+	}
 	if (n == TLBSHOOTDOWN_MAX) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
@@ -1158,13 +1273,47 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
+}
 
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	spinlock_acquire(&target->c_ipi_lock);
+
+	ipi_queueshootdown(target, mapping);
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
 }
 
+void
+ipi_tlbshootdown_wait(struct cpu *target,
+		      const struct tlbshootdown *mappings, unsigned n)
+{
+	unsigned i, ticket;
+	bool done;
+
+	KASSERT(target != curcpu->c_self);
+	KASSERT(curthread->t_iplhigh_count == 0);
+
+	spinlock_acquire(&target->c_ipi_lock);
+	for (i=0; i<n; i++) {
+		ipi_queueshootdown(target, &mappings[i]);
+	}
+	/* The next time the target finishes a batch, ours is in it. */
+	ticket = target->c_shootdown_seq;
+	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+	mainbus_send_ipi(target);
+	spinlock_release(&target->c_ipi_lock);
+
+	do {
+		spinlock_acquire(&target->c_ipi_lock);
+		done = target->c_shootdown_seq != ticket;
+		spinlock_release(&target->c_ipi_lock);
+	} while (!done);
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -1205,6 +1354,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_seq++;
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -0,0 +1,796 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vnode.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <sharedtext.h>
+#include <swap.h>
+
+/*
+ * Address spaces for the demand-paged VM system.
+ *
+ * An address space is a list of regions plus a page table. Defining a
+ * region costs no physical memory; frames are attached to individual
+ * pages by vm_fault the first time each one is touched. That includes
+ * the program itself: load_elf only records where each segment lives
+ * in the executable (as_define_file), and the pages are read in as
+ * they are used. Read-only segments are shared between processes.
+ */
+
+struct addrspace *
+as_create(void)
+{
+	struct addrspace *as;
+
+	as = kmalloc(sizeof(struct addrspace));
+	if (as == NULL) {
+		return NULL;
+	}
+
+	as->as_regions = NULL;
+	as->as_heap = NULL;
+	as->as_brk = 0;
+	as->as_tlb.ta_asid = 0;
+	as->as_tlb.ta_cpu = 0;
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+
+	return as;
+}
+
+/*
+ * Release the frame behind one PTE of an address space that is going
+ * away, and so has no TLB entries anyone can use. Used with pt_walk.
+ */
+static
+int
+as_freepage(void *data, vaddr_t vaddr, pte_t *pte)
+{
+	paddr_t pa;
+
+	(void)data;
+	(void)vaddr;
+
+	/* Wait out any page-out in progress, and keep new ones away. */
+	if (coremap_pin(pte, NULL, 0)) {
+		pa = *pte & PTE_FRAME;
+		*pte = 0;
+		coremap_unpin(pa);
+		coremap_decref(pa);
+	}
+	else if (*pte & PTE_SWAPPED) {
+		swap_discard(PTE_SWAPSLOT(*pte));
+	}
+	*pte = 0;
+	return 0;
+}
+
+/*
+ * Revoke the TLB entries batched in TB, then let go of the NFRAMES
+ * frames they mapped, which are pinned.
+ */
+static
+void
+as_unmapbatch(struct tlbbatch *tb, const paddr_t *frames, unsigned nframes)
+{
+	unsigned i;
+
+	vm_tlb_revokebatch(tb);
+	for (i=0; i<nframes; i++) {
+		coremap_unpin(frames[i]);
+		coremap_decref(frames[i]);
+	}
+}
+
+/*
+ * Release every page of AS from START up to END. The frames are only
+ * freed once their TLB entries are revoked, which is done in batches.
+ */
+static
+void
+as_unmaprange(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	paddr_t frames[TLBSHOOTDOWN_MAX];
+	struct tlbbatch tb;
+	vaddr_t va;
+	pte_t *pte;
+	unsigned n;
+
+	tlbbatch_init(&tb, &as->as_tlb);
+	n = 0;
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL || *pte == 0) {
+			continue;
+		}
+
+		/* Wait out any page-out in progress, and keep new ones away. */
+		if (coremap_pin(pte, NULL, 0)) {
+			frames[n++] = *pte & PTE_FRAME;
+			*pte = 0;
+			if (tlbbatch_add(&tb, va)) {
+				as_unmapbatch(&tb, frames, n);
+				n = 0;
+			}
+		}
+		else if (*pte & PTE_SWAPPED) {
+			swap_discard(PTE_SWAPSLOT(*pte));
+		}
+		*pte = 0;
+	}
+	as_unmapbatch(&tb, frames, n);
+}
+
+/*
+ * Release what a region holds on to, and the region itself. Its pages
+ * must already be gone.
+ */
+static
+void
+as_freeregion(struct region *rg)
+{
+	if (rg->rg_vnode != NULL) {
+		VOP_DECREF(rg->rg_vnode);
+	}
+	if (rg->rg_text != NULL) {
+		sharedtext_put(rg->rg_text);
+	}
+	kfree(rg);
+}
+
+void
+as_destroy(struct addrspace *as)
+{
+	struct region *rg;
+
+	pt_walk(as->as_pt, as_freepage, NULL);
+	pt_destroy(as->as_pt);
+
+	while (as->as_regions != NULL) {
+		rg = as->as_regions;
+		as->as_regions = rg->rg_next;
+		as_freeregion(rg);
+	}
+
+	vm_tlb_destroy(&as->as_tlb);
+	kfree(as);
+}
+
+void
+as_activate(void)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+#ifdef UW
+        /* Kernel threads don't have an address spaces to activate */
+#endif
+	if (as == NULL) {
+		return;
+	}
+
+	vm_tlb_activate(&as->as_tlb, as->as_pt);
+}
+
+void
+as_deactivate(void)
+{
+	/* The page table may be about to go away. */
+	vm_tlb_deactivate();
+}
+
+struct region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (vaddr >= rg->rg_base &&
+		    vaddr < rg->rg_base + rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add a region to AS, handing it back in RET if that isn't NULL. Fails
+ * with EINVAL if it would overlap an existing one or run into kernel
+ * space.
+ */
+static
+int
+as_addregion(struct addrspace *as, vaddr_t vaddr, size_t npages, int flags,
+	     struct region **ret)
+{
+	struct region *rg, **prev;
+	vaddr_t top;
+
+	top = vaddr + npages * PAGE_SIZE;
+	if (top < vaddr || top > USERSPACETOP) {
+		return EINVAL;
+	}
+
+	/* Keep the list sorted by address. */
+	for (prev = &as->as_regions; *prev != NULL; prev = &(*prev)->rg_next) {
+		rg = *prev;
+		if (top <= rg->rg_base) {
+			break;
+		}
+		if (vaddr < rg->rg_base + rg->rg_npages * PAGE_SIZE) {
+			return EINVAL;
+		}
+	}
+
+	rg = kmalloc(sizeof(struct region));
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	rg->rg_base = vaddr;
+	rg->rg_npages = npages;
+	rg->rg_flags = flags;
+	rg->rg_vnode = NULL;
+	rg->rg_fileva = 0;
+	rg->rg_offset = 0;
+	rg->rg_filesz = 0;
+	rg->rg_text = NULL;
+	rg->rg_textbase = 0;
+	rg->rg_next = *prev;
+	*prev = rg;
+
+	if (ret != NULL) {
+		*ret = rg;
+	}
+	return 0;
+}
+
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable)
+{
+	size_t npages;
+	int flags;
+
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	npages = sz / PAGE_SIZE;
+
+	flags = 0;
+	if (readable) {
+		flags |= RG_READ;
+	}
+	if (writeable) {
+		flags |= RG_WRITE;
+	}
+	if (executable) {
+		flags |= RG_EXEC;
+	}
+
+	return as_addregion(as, vaddr, npages, flags, NULL);
+}
+
+/*
+ * Attach file contents to the region defined for the segment at
+ * VADDR: FILESIZE bytes at OFFSET in V, followed by zeros out to
+ * MEMSIZE. Takes a reference to V, which is held until the address
+ * space is destroyed.
+ */
+int
+as_define_file(struct addrspace *as, struct vnode *v, off_t offset,
+	       vaddr_t vaddr, size_t memsize, size_t filesize)
+{
+	struct region *rg;
+
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+
+	rg = as_findregion(as, vaddr);
+	if (rg == NULL || rg->rg_vnode != NULL || rg->rg_text != NULL) {
+		return EINVAL;
+	}
+	KASSERT(vaddr + memsize <= rg->rg_base + rg->rg_npages * PAGE_SIZE);
+
+	if (filesize == 0) {
+		/* Nothing to read; it's all zero-fill. */
+		return 0;
+	}
+
+	DEBUG(DB_EXEC, "ELF: %lu bytes at 0x%lx will be paged in\n",
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	if ((rg->rg_flags & RG_WRITE) == 0) {
+		rg->rg_text = sharedtext_get(v, offset, vaddr, filesize);
+		if (rg->rg_text == NULL) {
+			return ENOMEM;
+		}
+		rg->rg_textbase = rg->rg_base;
+		return 0;
+	}
+
+	VOP_INCREF(v);
+	rg->rg_vnode = v;
+	rg->rg_fileva = vaddr;
+	rg->rg_offset = offset;
+	rg->rg_filesz = filesize;
+	return 0;
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+	/* Nothing to allocate up front; pages are read in on demand. */
+	(void)as;
+	return 0;
+}
+
+int
+as_complete_load(struct addrspace *as)
+{
+	struct region *rg;
+	vaddr_t base;
+
+	/* The heap starts out empty, just past the highest region. */
+	base = 0;
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		base = rg->rg_base + rg->rg_npages * PAGE_SIZE;
+	}
+
+	as->as_brk = base;
+	return as_addregion(as, base, 0, RG_READ | RG_WRITE, &as->as_heap);
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbrk)
+{
+	struct region *rg = as->as_heap;
+	vaddr_t newbrk, oldtop, newtop, limit;
+
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+
+	newbrk = as->as_brk + amount;
+	if (amount < 0 && newbrk > as->as_brk) {
+		return EINVAL;
+	}
+	if (amount > 0 && newbrk < as->as_brk) {
+		return ENOMEM;
+	}
+	if (newbrk < rg->rg_base) {
+		return EINVAL;
+	}
+
+	oldtop = rg->rg_base + rg->rg_npages * PAGE_SIZE;
+	newtop = (newbrk + PAGE_SIZE - 1) & PAGE_FRAME;
+	if (newtop < newbrk) {
+		return ENOMEM;
+	}
+
+	limit = rg->rg_next != NULL ? rg->rg_next->rg_base : USERSPACETOP;
+	if (newtop > limit) {
+		return ENOMEM;
+	}
+
+	rg->rg_npages = (newtop - rg->rg_base) / PAGE_SIZE;
+
+	/* Give back whatever was above the new top. */
+	as_unmaprange(as, newtop, oldtop);
+
+	*oldbrk = as->as_brk;
+	as->as_brk = newbrk;
+	return 0;
+}
+
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+	vaddr_t base;
+	int result;
+
+	base = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
+	result = as_addregion(as, base, VM_STACKPAGES, RG_READ | RG_WRITE,
+			      NULL);
+	if (result) {
+		return result;
+	}
+
+	/* No permissions at all, so vm_fault refuses any access. */
+	result = as_addregion(as, base - VM_GUARDPAGES * PAGE_SIZE,
+			      VM_GUARDPAGES, 0, NULL);
+	if (result) {
+		return result;
+	}
+
+	*stackptr = USERSTACK;
+	return 0;
+}
+
+/*
+ * Give the page at VADDR in NEWAS, in region RG, a private copy of the
+ * swapped-out page described by PTE, which stays where it is.
+ */
+static
+int
+as_copyswapped(struct addrspace *newas, struct region *rg, vaddr_t vaddr,
+	       pte_t *pte, pte_t *newpte)
+{
+	paddr_t pa;
+	bool fromdisk;
+	int result;
+
+	pa = coremap_alloc_upage(newas, vaddr);
+	if (pa == 0) {
+		return ENOMEM;
+	}
+	result = swap_pagein(PTE_SWAPSLOT(*pte), pa, &fromdisk);
+	if (result) {
+		coremap_decref(pa);
+		return result;
+	}
+	*newpte = pa | PTE_VALID;
+	if (rg->rg_flags & RG_WRITE) {
+		*newpte |= PTE_WRITE;
+	}
+	coremap_unpin(pa);
+	return 0;
+}
+
+/*
+ * State for as_sharepage while as_copy walks the parent's pages.
+ */
+struct as_copystate {
+	struct addrspace *cs_new;
+	struct tlbbatch cs_tlb;		/* parent pages made read-only */
+};
+
+/*
+ * Share the frame behind PTE with the page at VADDR in the new address
+ * space. Pages in writable regions lose write permission on both sides
+ * and are marked copy-on-write, so the first write on either side gets
+ * its own frame (see vm_fault), unless they are in a MAP_SHARED
+ * mapping. This goes by the region, not PTE_WRITE, since a page read
+ * back in from swap is mapped read-only until written. Pages out on
+ * swap are copied instead. Used with pt_walk, with DATA an
+ * as_copystate.
+ *
+ * The parent's writable TLB entries are revoked in batches, not one by
+ * one. That can wait until the walk is done: the parent is the thread
+ * running here, so nothing writes through them in the meantime.
+ */
+static
+int
+as_sharepage(void *data, vaddr_t vaddr, pte_t *pte)
+{
+	struct as_copystate *cs = data;
+	struct addrspace *newas = cs->cs_new;
+	struct region *rg;
+	pte_t *newpte;
+
+	rg = as_findregion(newas, vaddr);
+	KASSERT(rg != NULL);
+
+	newpte = pt_lookup(newas->as_pt, vaddr, true);
+	if (newpte == NULL) {
+		return ENOMEM;
+	}
+
+	/*
+	 * Only the parent (which is us) changes its nonresident
+	 * PTEs, so if the pin fails *pte stays as we see it.
+	 */
+	if (!coremap_pin(pte, curproc_getas(), vaddr)) {
+		if (*pte & PTE_SWAPPED) {
+			return as_copyswapped(newas, rg, vaddr, pte, newpte);
+		}
+		return 0;
+	}
+
+	/* If the parent's TLB entry allows writes, it must go. */
+	if ((rg->rg_flags & (RG_WRITE | RG_SHARED)) == RG_WRITE) {
+		if ((*pte & PTE_WRITE) && tlbbatch_add(&cs->cs_tlb, vaddr)) {
+			vm_tlb_revokebatch(&cs->cs_tlb);
+		}
+		*pte = (*pte & ~PTE_WRITE) | PTE_COW;
+	}
+	coremap_incref(*pte & PTE_FRAME);
+	*newpte = *pte;
+	coremap_unpin(*pte & PTE_FRAME);
+	return 0;
+}
+
+int
+as_copy(struct addrspace *old, struct addrspace **ret)
+{
+	struct as_copystate cs;
+	struct addrspace *new;
+	struct region *rg, *newrg;
+	int result;
+
+	new = as_create();
+	if (new==NULL) {
+		return ENOMEM;
+	}
+
+	for (rg = old->as_regions; rg != NULL; rg = rg->rg_next) {
+		result = as_addregion(new, rg->rg_base, rg->rg_npages,
+				      rg->rg_flags, &newrg);
+		if (result) {
+			as_destroy(new);
+			return result;
+		}
+
+		if (rg == old->as_heap) {
+			new->as_heap = newrg;
+		}
+
+		/* Pages the parent never touched still come from the file. */
+		if (rg->rg_vnode != NULL) {
+			VOP_INCREF(rg->rg_vnode);
+			newrg->rg_vnode = rg->rg_vnode;
+			newrg->rg_fileva = rg->rg_fileva;
+			newrg->rg_offset = rg->rg_offset;
+			newrg->rg_filesz = rg->rg_filesz;
+		}
+		if (rg->rg_text != NULL) {
+			sharedtext_incref(rg->rg_text);
+			newrg->rg_text = rg->rg_text;
+			newrg->rg_textbase = rg->rg_textbase;
+		}
+	}
+
+	KASSERT(old == curproc_getas());
+	cs.cs_new = new;
+	tlbbatch_init(&cs.cs_tlb, &old->as_tlb);
+	result = pt_walk(old->as_pt, as_sharepage, &cs);
+	vm_tlb_revokebatch(&cs.cs_tlb);
+	if (result) {
+		as_destroy(new);
+		return result;
+	}
+
+	new->as_brk = old->as_brk;
+	*ret = new;
+	return 0;
+}
+
+/*
+ * Find room for NPAGES pages in AS that nothing else is using. Takes
+ * the highest such place, so mappings pile up downward from the stack
+ * and leave the heap room to grow. Returns 0 if there is none.
+ */
+static
+vaddr_t
+as_findgap(struct addrspace *as, size_t npages)
+{
+	struct region *rg;
+	vaddr_t bottom, top, found;
+	size_t len = npages * PAGE_SIZE;
+
+	found = 0;
+	/* Never hand out page 0, so that NULL stays invalid. */
+	bottom = PAGE_SIZE;
+	for (rg = as->as_regions; ; rg = rg->rg_next) {
+		top = rg != NULL ? rg->rg_base : USERSPACETOP;
+		if (top > bottom && top - bottom >= len) {
+			found = top - len;
+		}
+		if (rg == NULL) {
+			break;
+		}
+		bottom = rg->rg_base + rg->rg_npages * PAGE_SIZE;
+	}
+	return found;
+}
+
+int
+as_mmap(struct addrspace *as, struct vnode *v, off_t offset, size_t len,
+	vaddr_t hint, int flags, bool shared, vaddr_t *ret)
+{
+	struct region *rg;
+	struct stat st;
+	size_t npages;
+	vaddr_t base;
+	int result;
+
+	KASSERT(len > 0);
+	KASSERT(offset >= 0 && offset % PAGE_SIZE == 0);
+
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	flags |= RG_MMAP;
+	if (shared) {
+		flags |= RG_SHARED;
+	}
+
+	/* Take the hint if nothing is in the way; EINVAL says something is. */
+	base = hint & PAGE_FRAME;
+	result = EINVAL;
+	if (base != 0) {
+		result = as_addregion(as, base, npages, flags, &rg);
+	}
+	if (result == EINVAL) {
+		base = as_findgap(as, npages);
+		if (base == 0) {
+			return ENOMEM;
+		}
+		result = as_addregion(as, base, npages, flags, &rg);
+	}
+	if (result) {
+		return result;
+	}
+
+	if (shared) {
+		rg->rg_text = sharedtext_getfile(v);
+		if (rg->rg_text == NULL) {
+			result = ENOMEM;
+			goto fail;
+		}
+		rg->rg_textbase = offset;
+	}
+	else {
+		/* Only what's in the file now is read; the rest is zero. */
+		result = VOP_STAT(v, &st);
+		if (result) {
+			goto fail;
+		}
+		if (st.st_size > offset) {
+			VOP_INCREF(v);
+			rg->rg_vnode = v;
+			rg->rg_fileva = base;
+			rg->rg_offset = offset;
+			rg->rg_filesz = st.st_size - offset < (off_t)len ?
+				st.st_size - offset : len;
+		}
+	}
+
+	*ret = base;
+	return 0;
+
+ fail:
+	as_munmap(as, base, npages * PAGE_SIZE);
+	return result;
+}
+
+/*
+ * Cut the pages in [START, STOP) out of RG, which is on the list at
+ * *PREV, leaving whatever is left of it on either side. TAIL is a
+ * spare region for the part above STOP when the cut is in the middle,
+ * which is used up (set to NULL) if so.
+ */
+static
+void
+as_cutregion(struct addrspace *as, struct region **prev, vaddr_t start,
+	     vaddr_t stop, struct region **tail)
+{
+	struct region *rg = *prev;
+	vaddr_t rgend;
+
+	rgend = rg->rg_base + rg->rg_npages * PAGE_SIZE;
+	KASSERT(rg->rg_base <= start && start < stop && stop <= rgend);
+
+	as_unmaprange(as, start, stop);
+
+	if (start == rg->rg_base && stop == rgend) {
+		*prev = rg->rg_next;
+		as_freeregion(rg);
+		return;
+	}
+
+	/*
+	 * The file data stays where it was (rg_fileva is an address, not
+	 * an offset), so only the shared object's key has to follow the
+	 * region's base.
+	 */
+	if (start > rg->rg_base && stop < rgend) {
+		KASSERT(*tail != NULL);
+		**tail = *rg;
+		(*tail)->rg_base = stop;
+		(*tail)->rg_npages = (rgend - stop) / PAGE_SIZE;
+		if (rg->rg_vnode != NULL) {
+			VOP_INCREF(rg->rg_vnode);
+		}
+		if (rg->rg_text != NULL) {
+			(*tail)->rg_textbase += stop - rg->rg_base;
+			sharedtext_incref(rg->rg_text);
+		}
+		rg->rg_next = *tail;
+		*tail = NULL;
+	}
+	if (start == rg->rg_base) {
+		if (rg->rg_text != NULL) {
+			rg->rg_textbase += stop - rg->rg_base;
+		}
+		rg->rg_base = stop;
+		rg->rg_npages = (rgend - stop) / PAGE_SIZE;
+	}
+	else {
+		rg->rg_npages = (start - rg->rg_base) / PAGE_SIZE;
+	}
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct region *rg, *tail, **prev;
+	vaddr_t end, rgend;
+	int result;
+
+	KASSERT(vaddr % PAGE_SIZE == 0);
+
+	end = vaddr + (len + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+	if (end <= vaddr || end > USERSPACETOP) {
+		return EINVAL;
+	}
+
+	/*
+	 * Check everything first, so that a failure leaves the mappings
+	 * as they were. Only mmap regions may be unmapped, and cutting a
+	 * hole in the middle of one takes a second region.
+	 */
+	tail = NULL;
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		rgend = rg->rg_base + rg->rg_npages * PAGE_SIZE;
+		if (rg->rg_npages == 0 ||
+		    rgend <= vaddr || rg->rg_base >= end) {
+			continue;
+		}
+		if ((rg->rg_flags & RG_MMAP) == 0) {
+			result = EINVAL;
+			goto fail;
+		}
+		if (rg->rg_base < vaddr && rgend > end) {
+			KASSERT(tail == NULL);
+			tail = kmalloc(sizeof(struct region));
+			if (tail == NULL) {
+				result = ENOMEM;
+				goto fail;
+			}
+		}
+		if (rg->rg_text != NULL) {
+			result = sharedtext_sync(rg->rg_text);
+			if (result) {
+				goto fail;
+			}
+		}
+	}
+
+	prev = &as->as_regions;
+	while ((rg = *prev) != NULL) {
+		rgend = rg->rg_base + rg->rg_npages * PAGE_SIZE;
+		if (rg->rg_npages == 0 ||
+		    rgend <= vaddr || rg->rg_base >= end) {
+			prev = &rg->rg_next;
+			continue;
+		}
+		as_cutregion(as, prev,
+			     rg->rg_base > vaddr ? rg->rg_base : vaddr,
+			     rgend < end ? rgend : end, &tail);
+		if (*prev == rg) {
+			prev = &rg->rg_next;
+		}
+	}
+	KASSERT(tail == NULL);
+	return 0;
+
+ fail:
+	if (tail != NULL) {
+		kfree(tail);
+	}
+	return result;
+}
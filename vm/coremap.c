@@ -0,0 +1,1631 @@
+#include "opt-dumbvm.h"
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <thread.h>
+#include <wchan.h>
+#include <clock.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <swap.h>
+#include <uw-vmstats.h>
+
+/*
+ * Coremap: per-frame bookkeeping for all of physical memory.
+ *
+ * The table itself is carved out of the bottom of the memory that
+ * ram_getsize() reports, so it covers every frame from physical page 0
+ * up to the top of RAM and can be indexed directly by page number.
+ *
+ * Free frames are managed by a binary buddy allocator (see coremap.h).
+ * Only the first frame of a free block is on a free list; it records
+ * the block's size in cme_npages, which is how a frame freeing its way
+ * up finds out whether its buddy can be merged with.
+ *
+ * A page daemon keeps some frames free by paging out user frames that
+ * haven't been used lately, found with a two-handed clock (see
+ * coremap_daemon). There is no hardware referenced bit, so "recently
+ * used" means "pinned by a fault since the front hand last passed".
+ * If a user page needs a frame and none is free anyway, the back hand
+ * is run right there to page one out.
+ *
+ * A frame read back in from swap keeps its slot (cme_clean) until the
+ * page is first written, so paging it out again is free.
+ *
+ * Each cpu keeps a few free frames of its own (struct cpu's frame
+ * cache) for single-page allocations, taken from and given back to
+ * the global free frames CPU_FRAMEBATCH at a time. Cached frames are
+ * marked CME_CPU, which nobody else looks at, so the owning cpu can
+ * set them up for use without the coremap lock. If the free frames
+ * run out, every cpu's cache is emptied back into them before giving
+ * up.
+ *
+ * Lock order: a cpu's frame cache lock, then the coremap lock.
+ *
+ * Idle cpus zero free frames ahead of time and stack them up in the
+ * zero pool, which zero-fill faults draw from first. Frames in the
+ * pool don't count as free to coremap_claim; if it comes up short, it
+ * empties the pool back into the free frames and tries again.
+ */
+
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+static struct coremap_entry *coremap;	/* one entry per frame */
+static unsigned coremap_nframes;	/* total frames, including fixed */
+static unsigned coremap_firstfree;	/* first managed frame */
+static unsigned coremap_nfree;		/* frames currently free */
+static unsigned coremap_freelist[COREMAP_NORDERS];	/* block heads */
+static unsigned coremap_clock;		/* page-out clock hand */
+static struct wchan *coremap_wchan;	/* for waiting on busy frames */
+static unsigned coremap_zeropool[COREMAP_ZEROPOOL];	/* CME_ZERO frames */
+static unsigned coremap_nzero;		/* frames in the zero pool */
+static unsigned coremap_nzeroing;	/* frames being zeroed for it */
+static bool coremap_ready = false;
+
+#if !OPT_DUMBVM
+/* The page daemon; see coremap_startdaemon */
+static struct wchan *coremap_daemonwchan;	/* daemon sleeps here */
+static unsigned coremap_fronthand;	/* reference-clearing clock hand */
+static unsigned coremap_lowater;	/* wake the daemon below this */
+static unsigned coremap_hiwater;	/* ...and run it up to this */
+#endif
+
+/* Per-order statistics, for coremap_printstats */
+static unsigned coremap_nblocks[COREMAP_NORDERS];	/* free blocks now */
+static unsigned coremap_nallocs[COREMAP_NORDERS];	/* requests */
+static unsigned coremap_nfails[COREMAP_NORDERS];	/* ...that failed */
+static unsigned coremap_nsplits[COREMAP_NORDERS];	/* blocks split */
+static unsigned coremap_nmerges[COREMAP_NORDERS];	/* blocks merged */
+
+/* How many frames a cpu's cache takes or gives back at once */
+#define CPU_FRAMEBATCH  (CPU_FRAMECACHE / 2)
+
+#define PADDR_TO_FRAME(pa)  ((unsigned)((pa) / PAGE_SIZE))
+#define FRAME_TO_PADDR(fr)  ((paddr_t)(fr) * PAGE_SIZE)
+
+/*
+ * Put the free block of 2^ORDER frames starting at FRAME on its free
+ * list.
+ */
+static
+void
+coremap_listadd(unsigned frame, unsigned order)
+{
+	unsigned head;
+
+	KASSERT(coremap[frame].cme_state == CME_FREE);
+
+	head = coremap_freelist[order];
+	coremap[frame].cme_npages = 1U << order;
+	coremap[frame].cme_prev = 0;
+	coremap[frame].cme_next = head;
+	if (head != 0) {
+		coremap[head].cme_prev = frame;
+	}
+	coremap_freelist[order] = frame;
+	coremap_nblocks[order]++;
+}
+
+/*
+ * Take the free block at FRAME off the free list for ORDER.
+ */
+static
+void
+coremap_listremove(unsigned frame, unsigned order)
+{
+	struct coremap_entry *cme = &coremap[frame];
+
+	KASSERT(cme->cme_state == CME_FREE);
+	KASSERT(cme->cme_npages == 1U << order);
+
+	if (cme->cme_prev != 0) {
+		coremap[cme->cme_prev].cme_next = cme->cme_next;
+	}
+	else {
+		KASSERT(coremap_freelist[order] == frame);
+		coremap_freelist[order] = cme->cme_next;
+	}
+	if (cme->cme_next != 0) {
+		coremap[cme->cme_next].cme_prev = cme->cme_prev;
+	}
+	cme->cme_npages = 0;
+	cme->cme_next = cme->cme_prev = 0;
+	coremap_nblocks[order]--;
+}
+
+/*
+ * Free the block of 2^ORDER frames at FRAME, which are already marked
+ * CME_FREE, merging it with its buddy for as long as that is free too.
+ * Doesn't touch coremap_nfree.
+ */
+static
+void
+coremap_buddyfree(unsigned frame, unsigned order)
+{
+	unsigned buddy;
+
+	while (order + 1 < COREMAP_NORDERS) {
+		buddy = coremap_firstfree +
+			((frame - coremap_firstfree) ^ (1U << order));
+		if (buddy + (1U << order) > coremap_nframes ||
+		    coremap[buddy].cme_state != CME_FREE ||
+		    coremap[buddy].cme_npages != 1U << order) {
+			break;
+		}
+		coremap_listremove(buddy, order);
+		coremap_nmerges[order]++;
+		if (buddy < frame) {
+			frame = buddy;
+		}
+		order++;
+	}
+	coremap_listadd(frame, order);
+}
+
+/*
+ * Free NPAGES frames starting at FRAME, already marked CME_FREE, as
+ * the largest aligned blocks that fit.
+ */
+static
+void
+coremap_freerange(unsigned frame, unsigned npages)
+{
+	unsigned order;
+
+	while (npages > 0) {
+		order = 0;
+		while (order + 1 < COREMAP_NORDERS &&
+		       ((frame - coremap_firstfree) & ((2U << order) - 1)) == 0 &&
+		       (2U << order) <= npages) {
+			order++;
+		}
+		coremap_buddyfree(frame, order);
+		frame += 1U << order;
+		npages -= 1U << order;
+	}
+}
+
+/*
+ * Take a free block of 2^ORDER frames, splitting a bigger one if need
+ * be. Returns its first frame, or 0 if there's nothing big enough.
+ */
+static
+unsigned
+coremap_buddyalloc(unsigned order)
+{
+	unsigned k, frame;
+
+	for (k = order; k < COREMAP_NORDERS; k++) {
+		if (coremap_freelist[k] != 0) {
+			break;
+		}
+	}
+	if (k == COREMAP_NORDERS) {
+		return 0;
+	}
+
+	frame = coremap_freelist[k];
+	coremap_listremove(frame, k);
+	while (k > order) {
+		coremap_nsplits[k]++;
+		k--;
+		coremap_listadd(frame + (1U << k), k);
+	}
+	return frame;
+}
+
+/*
+ * Return the smallest order whose blocks hold NPAGES frames.
+ */
+static
+unsigned
+coremap_order(unsigned long npages)
+{
+	unsigned order;
+
+	order = 0;
+	while (order < COREMAP_NORDERS && (1UL << order) < npages) {
+		order++;
+	}
+	return order;
+}
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t lo, hi;
+	size_t cmbytes;
+	unsigned cmpages, i;
+
+	KASSERT(!coremap_ready);
+
+	ram_getsize(&lo, &hi);
+	KASSERT((lo & PAGE_FRAME) == lo);
+	KASSERT((hi & PAGE_FRAME) == hi);
+
+	coremap_nframes = PADDR_TO_FRAME(hi);
+	cmbytes = coremap_nframes * sizeof(struct coremap_entry);
+	cmpages = (cmbytes + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	if (lo + cmpages * PAGE_SIZE >= hi) {
+		panic("coremap: not enough memory for the coremap itself\n");
+	}
+
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(lo);
+	coremap_firstfree = PADDR_TO_FRAME(lo) + cmpages;
+
+	for (i=0; i<coremap_nframes; i++) {
+		coremap[i].cme_busy = 0;
+		coremap[i].cme_recent = 0;
+		coremap[i].cme_clean = 0;
+		coremap[i].cme_merged = 0;
+		coremap[i].cme_swapslot = 0;
+		coremap[i].cme_hash = 0;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_as = NULL;
+		coremap[i].cme_vaddr = 0;
+		coremap[i].cme_next = 0;
+		coremap[i].cme_prev = 0;
+		if (i < coremap_firstfree) {
+			coremap[i].cme_state = CME_FIXED;
+		}
+		else {
+			coremap[i].cme_state = CME_FREE;
+		}
+	}
+
+	coremap_nfree = coremap_nframes - coremap_firstfree;
+	coremap_freerange(coremap_firstfree, coremap_nfree);
+	coremap_clock = coremap_firstfree;
+
+	spinlock_acquire(&coremap_lock);
+	coremap_ready = true;
+	spinlock_release(&coremap_lock);
+
+	/* This kmallocs, so it has to wait until the coremap is live. */
+	coremap_wchan = wchan_create("coremap");
+	if (coremap_wchan == NULL) {
+		panic("coremap: cannot create wchan\n");
+	}
+
+	kprintf("coremap: %u frames, %u free (%uk for the coremap)\n",
+		coremap_nframes, coremap_nfree, cmpages * PAGE_SIZE / 1024);
+}
+
+/*
+ * Give every frame in the zero pool back to the free frames.
+ */
+static
+void
+coremap_drainzero(void)
+{
+	unsigned frame;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	while (coremap_nzero > 0) {
+		frame = coremap_zeropool[--coremap_nzero];
+		KASSERT(coremap[frame].cme_state == CME_ZERO);
+		coremap[frame].cme_state = CME_FREE;
+		coremap[frame].cme_npages = 0;
+		coremap_buddyfree(frame, 0);
+		coremap_nfree++;
+	}
+}
+
+/*
+ * Find and claim NPAGES contiguous free frames, marking them STATE.
+ * Returns 0 if there is no such run.
+ */
+static
+paddr_t
+coremap_claim(unsigned long npages, uint8_t state)
+{
+	unsigned order, first, i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(coremap_ready);
+
+	order = coremap_order(npages);
+	if (order == COREMAP_NORDERS) {
+		return 0;
+	}
+	coremap_nallocs[order]++;
+
+	first = coremap_buddyalloc(order);
+	if (first == 0 && coremap_nzero > 0) {
+		coremap_drainzero();
+		first = coremap_buddyalloc(order);
+	}
+	if (first == 0) {
+		coremap_nfails[order]++;
+		return 0;
+	}
+
+	for (i=first; i<first+npages; i++) {
+		KASSERT(coremap[i].cme_state == CME_FREE);
+		KASSERT(coremap[i].cme_busy == 0);
+		coremap[i].cme_state = state;
+		coremap[i].cme_npages = 0;
+	}
+	coremap[first].cme_npages = npages;
+	coremap_nfree -= npages;
+
+#if !OPT_DUMBVM
+	if (coremap_daemonwchan != NULL &&
+	    coremap_nfree + coremap_nzero < coremap_lowater) {
+		wchan_wakeone(coremap_daemonwchan);
+	}
+#endif
+
+	/* Give back whatever part of the block we don't need. */
+	coremap_freerange(first + npages, (1U << order) - npages);
+
+	return FRAME_TO_PADDR(first);
+}
+
+/*
+ * Give cached frames of cpu C back to the free frames until only KEEP
+ * are left.
+ */
+static
+void
+coremap_cpudrain(struct cpu *c, unsigned keep)
+{
+	unsigned frame;
+
+	KASSERT(spinlock_do_i_hold(&c->c_framelock));
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	while (c->c_nfreeframes > keep) {
+		frame = c->c_freeframes[--c->c_nfreeframes];
+		KASSERT(coremap[frame].cme_state == CME_CPU);
+		coremap[frame].cme_state = CME_FREE;
+		coremap[frame].cme_npages = 0;
+		coremap_buddyfree(frame, 0);
+		coremap_nfree++;
+	}
+}
+
+/*
+ * Empty one cpu's cache entirely. Used with cpu_foreach.
+ */
+static
+void
+coremap_cpuflush(struct cpu *c, void *data)
+{
+	(void)data;
+
+	spinlock_acquire(&c->c_framelock);
+	spinlock_acquire(&coremap_lock);
+	coremap_cpudrain(c, 0);
+	spinlock_release(&coremap_lock);
+	spinlock_release(&c->c_framelock);
+}
+
+/*
+ * Take up to a batch of free frames into the cache of cpu C.
+ */
+static
+void
+coremap_cpurefill(struct cpu *c)
+{
+	paddr_t pa;
+
+	KASSERT(spinlock_do_i_hold(&c->c_framelock));
+
+	spinlock_acquire(&coremap_lock);
+	while (c->c_nfreeframes < CPU_FRAMEBATCH) {
+		pa = coremap_claim(1, CME_CPU);
+		if (pa == 0) {
+			break;
+		}
+		c->c_freeframes[c->c_nfreeframes++] = PADDR_TO_FRAME(pa);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Take a frame from this cpu's cache, refilling it if it's empty.
+ * If there's no free memory left, empty every cpu's cache first. The
+ * frame is returned still marked CME_CPU, for the caller to set up.
+ * Returns 0 if no frame is free.
+ */
+static
+unsigned
+coremap_cpuget(void)
+{
+	struct cpu *c;
+	unsigned frame;
+
+	KASSERT(coremap_ready);
+
+	/*
+	 * If we move to another cpu after reading curcpu, we just use
+	 * the old one's cache; it's protected by its lock either way.
+	 */
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_framelock);
+	if (c->c_nfreeframes == 0) {
+		coremap_cpurefill(c);
+	}
+	if (c->c_nfreeframes == 0) {
+		spinlock_release(&c->c_framelock);
+		cpu_foreach(coremap_cpuflush, NULL);
+		spinlock_acquire(&c->c_framelock);
+		coremap_cpurefill(c);
+	}
+	frame = 0;
+	if (c->c_nfreeframes > 0) {
+		frame = c->c_freeframes[--c->c_nfreeframes];
+		KASSERT(coremap[frame].cme_state == CME_CPU);
+	}
+	spinlock_release(&c->c_framelock);
+	return frame;
+}
+
+/*
+ * Put FRAME, which the caller has marked CME_CPU, in this cpu's cache,
+ * first giving a batch back to the free frames if it's full.
+ */
+static
+void
+coremap_cpuput(unsigned frame)
+{
+	struct cpu *c;
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_framelock);
+	if (c->c_nfreeframes == CPU_FRAMECACHE) {
+		spinlock_acquire(&coremap_lock);
+		coremap_cpudrain(c, CPU_FRAMECACHE - CPU_FRAMEBATCH);
+		spinlock_release(&coremap_lock);
+	}
+	c->c_freeframes[c->c_nfreeframes++] = frame;
+	spinlock_release(&c->c_framelock);
+}
+
+#if OPT_DUMBVM
+
+/* dumbvm has no swap. */
+static
+paddr_t
+coremap_evict(void)
+{
+	return 0;
+}
+
+static
+void
+coremap_discard(unsigned slot)
+{
+	(void)slot;
+	panic("coremap: dumbvm frame with a swap copy\n");
+}
+
+#else /* !OPT_DUMBVM */
+
+/*
+ * Whether the frame behind CME is one we can page out: a user frame,
+ * not pinned, mapped exactly once, with a known owner.
+ */
+#define COREMAP_PAGEABLE(cme) \
+	((cme)->cme_state == CME_USER && !(cme)->cme_busy && \
+	 (cme)->cme_refcount == 1 && (cme)->cme_as != NULL)
+
+static
+void
+coremap_discard(unsigned slot)
+{
+	swap_discard(slot);
+}
+
+/*
+ * Run the back clock hand over the user frames looking for one to
+ * page out: pageable, and not used since the front hand (or, if the
+ * page daemon isn't keeping up, this hand) last came by. Returns the
+ * frame number, or coremap_nframes if two full turns turn up nothing.
+ */
+static
+unsigned
+coremap_findvictim(void)
+{
+	struct coremap_entry *cme;
+	unsigned n, frame;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	for (n=0; n<2*(coremap_nframes - coremap_firstfree); n++) {
+		frame = coremap_clock++;
+		if (coremap_clock == coremap_nframes) {
+			coremap_clock = coremap_firstfree;
+		}
+
+		cme = &coremap[frame];
+		if (!COREMAP_PAGEABLE(cme)) {
+			continue;
+		}
+		if (cme->cme_recent) {
+			cme->cme_recent = 0;
+			continue;
+		}
+		return frame;
+	}
+	return coremap_nframes;
+}
+
+/*
+ * Page out FRAME, which must be pageable; the coremap lock must be
+ * held, and is released. A clean frame just hands its swap slot back
+ * to the PTE; anything else is written out. On success the frame is
+ * returned pinned, still CME_USER with a count of 1 but no owner, and
+ * *WROTE says whether it had to be written.
+ */
+static
+int
+coremap_pageout(unsigned frame, bool *wrote)
+{
+	struct coremap_entry *cme = &coremap[frame];
+	struct addrspace *as;
+	vaddr_t vaddr;
+	unsigned slot;
+	bool clean;
+	int result;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(COREMAP_PAGEABLE(cme));
+
+	cme->cme_busy = 1;
+	as = cme->cme_as;
+	vaddr = cme->cme_vaddr;
+	clean = cme->cme_clean;
+	slot = cme->cme_swapslot;
+	spinlock_release(&coremap_lock);
+
+	if (clean) {
+		swap_pageclean(as, vaddr, FRAME_TO_PADDR(frame), slot);
+		result = 0;
+	}
+	else {
+		result = swap_pageout(as, vaddr, FRAME_TO_PADDR(frame));
+	}
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cme->cme_busy);
+	KASSERT(cme->cme_refcount == 1);
+	if (result == 0) {
+		cme->cme_as = NULL;
+		cme->cme_vaddr = 0;
+		cme->cme_recent = 0;
+		cme->cme_clean = 0;
+		cme->cme_hash = 0;
+		*wrote = !clean;
+	}
+	else {
+		cme->cme_busy = 0;
+		wchan_wakeall(coremap_wchan);
+	}
+	spinlock_release(&coremap_lock);
+	return result;
+}
+
+/*
+ * Page out a user frame to make room, right now. Returns it pinned,
+ * still CME_USER with a count of 1 but no owner, for the caller to
+ * hand on; or 0 if there's no swap space, nothing can be paged out,
+ * or we may not sleep here. The page daemon normally keeps enough
+ * frames free that this isn't needed.
+ */
+static
+paddr_t
+coremap_evict(void)
+{
+	unsigned frame;
+	bool wrote;
+	int result;
+
+	if (!swap_enabled()) {
+		return 0;
+	}
+	if (curthread->t_in_interrupt || curthread->t_iplhigh_count > 0) {
+		/* Page-out sleeps; not allowed here. */
+		return 0;
+	}
+
+	while (1) {
+		spinlock_acquire(&coremap_lock);
+		frame = coremap_findvictim();
+		if (frame == coremap_nframes) {
+			spinlock_release(&coremap_lock);
+			return 0;
+		}
+		result = coremap_pageout(frame, &wrote);
+		if (result == 0) {
+			return FRAME_TO_PADDR(frame);
+		}
+		if (result == ENOSPC) {
+			/* Swap is full; trying other pages won't help. */
+			return 0;
+		}
+		/* This one couldn't be paged out right now; try another. */
+	}
+}
+
+/*
+ * The page daemon.
+ *
+ * MIPS has no referenced bit, so we make one: the front hand of a
+ * two-handed clock clears cme_recent on each pageable frame it passes,
+ * marks its PTE PTE_NOREFILL so the UTLB handler won't reload it, and
+ * revokes the TLB entry, a batch at a time. The next use of the page
+ * then takes a TLB miss all the way to vm_fault, which pins the frame
+ * to reload it; that sets cme_recent again. The back hand follows COREMAP_HANDSPREAD
+ * frames behind and pages out whatever is still unmarked, freeing the
+ * frame. (It shares coremap_clock with coremap_evict.)
+ *
+ * The daemon sleeps until free frames drop below the low-water mark,
+ * then runs the hands until they reach the high-water mark, so that
+ * faults normally find a free frame and never page out themselves.
+ */
+
+/* Distance from the front hand back to the back hand, in frames */
+#define COREMAP_HANDSPREAD	64
+
+/*
+ * Advance the front hand over up to TLBSHOOTDOWN_MAX frames, stopping
+ * early at a pageable frame of a different address space from the
+ * first, so that the entries it revokes go in one batch. Returns the
+ * number of frames passed.
+ */
+static
+unsigned
+coremap_fronthand_sweep(void)
+{
+	unsigned frames[TLBSHOOTDOWN_MAX];
+	struct coremap_entry *cme;
+	struct addrspace *as;
+	struct tlbbatch tb;
+	unsigned n, i, nscanned;
+	pte_t *pte;
+
+	as = NULL;
+	tlbbatch_init(&tb, NULL);
+
+	spinlock_acquire(&coremap_lock);
+	for (n=0; n<TLBSHOOTDOWN_MAX; n++) {
+		cme = &coremap[coremap_fronthand];
+		if (COREMAP_PAGEABLE(cme)) {
+			if (as == NULL) {
+				as = cme->cme_as;
+				tlbbatch_init(&tb, &as->as_tlb);
+			}
+			else if (cme->cme_as != as) {
+				/* Leave it for the next sweep. */
+				break;
+			}
+			/* Pinning it keeps the owner from going away. */
+			cme->cme_recent = 0;
+			cme->cme_busy = 1;
+			pte = pt_lookup(as->as_pt, cme->cme_vaddr, false);
+			KASSERT(pte != NULL);
+			KASSERT((*pte & PTE_FRAME) ==
+				FRAME_TO_PADDR(coremap_fronthand));
+			*pte |= PTE_NOREFILL;
+			frames[tb.tb_n] = coremap_fronthand;
+			(void)tlbbatch_add(&tb, cme->cme_vaddr);
+		}
+		if (++coremap_fronthand == coremap_nframes) {
+			coremap_fronthand = coremap_firstfree;
+		}
+	}
+	spinlock_release(&coremap_lock);
+
+	nscanned = tb.tb_n;
+	if (nscanned == 0) {
+		return n;
+	}
+
+	vm_tlb_revokebatch(&tb);
+
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<nscanned; i++) {
+		coremap[frames[i]].cme_busy = 0;
+	}
+	wchan_wakeall(coremap_wchan);
+	spinlock_release(&coremap_lock);
+
+	for (i=0; i<nscanned; i++) {
+		vmstats_inc(VMSTAT_PAGES_SCANNED);
+	}
+	return n;
+}
+
+/*
+ * Advance the back hand one frame, paging it out and freeing it if it
+ * hasn't been used. Returns ENOSPC if swap is full, otherwise 0.
+ */
+static
+int
+coremap_backhand_step(void)
+{
+	struct coremap_entry *cme;
+	unsigned frame;
+	bool wrote;
+	int result;
+
+	spinlock_acquire(&coremap_lock);
+	frame = coremap_clock++;
+	if (coremap_clock == coremap_nframes) {
+		coremap_clock = coremap_firstfree;
+	}
+	cme = &coremap[frame];
+	if (!COREMAP_PAGEABLE(cme) || cme->cme_recent) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+
+	result = coremap_pageout(frame, &wrote);
+	if (result) {
+		return result == ENOSPC ? ENOSPC : 0;
+	}
+
+	/* Anyone waiting on it will find their PTE changed. */
+	spinlock_acquire(&coremap_lock);
+	cme->cme_refcount = 0;
+	cme->cme_busy = 0;
+	cme->cme_state = CME_FREE;
+	cme->cme_npages = 0;
+	coremap_buddyfree(frame, 0);
+	coremap_nfree++;
+	wchan_wakeall(coremap_wchan);
+	spinlock_release(&coremap_lock);
+
+	vmstats_inc(VMSTAT_PAGES_RECLAIMED);
+	if (wrote) {
+		vmstats_inc(VMSTAT_PAGES_WRITTEN);
+	}
+	return 0;
+}
+
+/*
+ * Run both hands until free frames reach the high-water mark, swap is
+ * full, or two full turns (enough to clear and then find any unused
+ * frame there is) have gone by. Returns true if it reached the mark.
+ */
+static
+bool
+coremap_daemon_pass(void)
+{
+	unsigned n, i, turn, swept;
+	bool low;
+
+	turn = 2 * (coremap_nframes - coremap_firstfree);
+	for (n=0; n<turn; n += swept) {
+		spinlock_acquire(&coremap_lock);
+		low = coremap_nfree + coremap_nzero < coremap_hiwater;
+		spinlock_release(&coremap_lock);
+		if (!low) {
+			return true;
+		}
+
+		/* Keep the back hand the same distance behind. */
+		swept = coremap_fronthand_sweep();
+		for (i=0; i<swept; i++) {
+			if (coremap_backhand_step() == ENOSPC) {
+				return false;
+			}
+		}
+	}
+	return false;
+}
+
+static
+void
+coremap_daemon(void *data1, unsigned long data2)
+{
+	bool done;
+
+	(void)data1;
+	(void)data2;
+
+	done = true;
+	while (1) {
+		/*
+		 * Sleep until coremap_claim sees us drop below the low
+		 * mark. If the last pass fell short, wait for the next
+		 * allocation regardless; there's no point spinning.
+		 */
+		spinlock_acquire(&coremap_lock);
+		if (!done ||
+		    coremap_nfree + coremap_nzero >= coremap_lowater) {
+			wchan_lock(coremap_daemonwchan);
+			spinlock_release(&coremap_lock);
+			wchan_sleep(coremap_daemonwchan);
+		}
+		else {
+			spinlock_release(&coremap_lock);
+		}
+
+		done = coremap_daemon_pass();
+	}
+}
+
+void
+coremap_startdaemon(void)
+{
+	unsigned nmanaged;
+	int result;
+
+	KASSERT(coremap_ready);
+
+	nmanaged = coremap_nframes - coremap_firstfree;
+	coremap_lowater = nmanaged / 32;
+	if (coremap_lowater < 8) {
+		coremap_lowater = 8;
+	}
+	coremap_hiwater = 2 * coremap_lowater;
+	coremap_fronthand = coremap_firstfree +
+		(coremap_clock - coremap_firstfree + COREMAP_HANDSPREAD) %
+		nmanaged;
+
+	coremap_daemonwchan = wchan_create("pagedaemon");
+	if (coremap_daemonwchan == NULL) {
+		panic("coremap: cannot create daemon wchan\n");
+	}
+
+	result = thread_fork("pagedaemon", NULL, coremap_daemon, NULL, 0);
+	if (result) {
+		panic("coremap: cannot start page daemon: %s\n",
+		      strerror(result));
+	}
+
+}
+
+#endif /* OPT_DUMBVM */
+
+paddr_t
+coremap_alloc(unsigned long npages)
+{
+	struct coremap_entry *cme;
+	unsigned frame;
+	paddr_t pa;
+
+	KASSERT(npages > 0);
+
+	spinlock_acquire(&coremap_lock);
+	if (!coremap_ready) {
+		pa = ram_stealmem(npages);
+		spinlock_release(&coremap_lock);
+		return pa;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (npages == 1) {
+		frame = coremap_cpuget();
+		if (frame != 0) {
+			cme = &coremap[frame];
+			cme->cme_refcount = 0;
+			cme->cme_npages = 1;
+			cme->cme_state = CME_KERNEL;
+			return FRAME_TO_PADDR(frame);
+		}
+
+		/* Single pages can be had by paging something out. */
+		pa = coremap_evict();
+		if (pa != 0) {
+			spinlock_acquire(&coremap_lock);
+			cme = &coremap[PADDR_TO_FRAME(pa)];
+			cme->cme_state = CME_KERNEL;
+			cme->cme_refcount = 0;
+			cme->cme_npages = 1;
+			cme->cme_busy = 0;
+			/* Anyone waiting on it will find their PTE changed. */
+			wchan_wakeall(coremap_wchan);
+			spinlock_release(&coremap_lock);
+		}
+		return pa;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	pa = coremap_claim(npages, CME_KERNEL);
+	spinlock_release(&coremap_lock);
+
+	if (pa == 0) {
+		/*
+		 * The run might be broken up by frames sitting in cpu
+		 * caches. (It would also need its neighbours paged out;
+		 * we don't try that.)
+		 */
+		cpu_foreach(coremap_cpuflush, NULL);
+		spinlock_acquire(&coremap_lock);
+		pa = coremap_claim(npages, CME_KERNEL);
+		spinlock_release(&coremap_lock);
+	}
+
+	return pa;
+}
+
+paddr_t
+coremap_alloc_upage(struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *cme;
+	unsigned frame;
+	paddr_t pa;
+
+	frame = coremap_cpuget();
+	if (frame != 0) {
+		/*
+		 * Nobody else looks at a CME_CPU frame, so it can be set
+		 * up without the lock as long as the state goes last.
+		 */
+		cme = &coremap[frame];
+		cme->cme_busy = 1;
+		cme->cme_refcount = 1;
+		cme->cme_recent = 1;
+		cme->cme_as = as;
+		cme->cme_vaddr = vaddr;
+		cme->cme_npages = 1;
+		cme->cme_state = CME_USER;
+		return FRAME_TO_PADDR(frame);
+	}
+
+	pa = coremap_evict();
+	if (pa == 0) {
+		return 0;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	cme = &coremap[PADDR_TO_FRAME(pa)];
+	KASSERT(cme->cme_busy);
+	cme->cme_refcount = 1;
+	cme->cme_recent = 1;
+	cme->cme_as = as;
+	cme->cme_vaddr = vaddr;
+	spinlock_release(&coremap_lock);
+
+	return pa;
+}
+
+paddr_t
+coremap_alloc_zupage(struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *cme;
+	unsigned frame;
+	paddr_t pa;
+
+	spinlock_acquire(&coremap_lock);
+	if (coremap_nzero > 0) {
+		frame = coremap_zeropool[--coremap_nzero];
+		cme = &coremap[frame];
+		KASSERT(cme->cme_state == CME_ZERO);
+		KASSERT(cme->cme_busy == 0);
+		cme->cme_state = CME_USER;
+		cme->cme_busy = 1;
+		cme->cme_refcount = 1;
+		cme->cme_recent = 1;
+		cme->cme_as = as;
+		cme->cme_vaddr = vaddr;
+		spinlock_release(&coremap_lock);
+		return FRAME_TO_PADDR(frame);
+	}
+	spinlock_release(&coremap_lock);
+
+	/* Pool's empty; do it the slow way. */
+	pa = coremap_alloc_upage(as, vaddr);
+	if (pa != 0) {
+		bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+	}
+	return pa;
+}
+
+/*
+ * Return the coremap entry for user frame PADDR.
+ */
+static
+struct coremap_entry *
+coremap_uentry(paddr_t paddr)
+{
+	unsigned frame;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	frame = PADDR_TO_FRAME(paddr);
+	KASSERT(frame >= coremap_firstfree && frame < coremap_nframes);
+	KASSERT(coremap[frame].cme_state == CME_USER);
+	KASSERT(coremap[frame].cme_refcount > 0);
+	return &coremap[frame];
+}
+
+void
+coremap_incref(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+
+	spinlock_acquire(&coremap_lock);
+	cme = coremap_uentry(paddr);
+	KASSERT(cme->cme_refcount < 0xffff);
+	cme->cme_refcount++;
+	/* Shared now, so there's no single owner to page it out for. */
+	cme->cme_as = NULL;
+	cme->cme_vaddr = 0;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_decref(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+	unsigned slot;
+	bool freed, clean;
+
+	spinlock_acquire(&coremap_lock);
+	cme = coremap_uentry(paddr);
+	cme->cme_refcount--;
+	freed = cme->cme_refcount == 0;
+	clean = false;
+	slot = 0;
+	if (cme->cme_refcount <= 1) {
+		/* Nothing left to share it with. */
+		cme->cme_merged = 0;
+	}
+	if (freed) {
+		/* Nobody else can be waiting for it; it's unmapped. */
+		cme->cme_busy = 0;
+		cme->cme_state = CME_CPU;
+		cme->cme_as = NULL;
+		cme->cme_vaddr = 0;
+		clean = cme->cme_clean;
+		slot = cme->cme_swapslot;
+		cme->cme_clean = 0;
+		cme->cme_hash = 0;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (clean) {
+		/* The copy on swap has no PTE left to go back to. */
+		coremap_discard(slot);
+	}
+	if (freed) {
+		coremap_cpuput(PADDR_TO_FRAME(paddr));
+	}
+}
+
+unsigned
+coremap_refcount(paddr_t paddr)
+{
+	unsigned n;
+
+	spinlock_acquire(&coremap_lock);
+	n = coremap_uentry(paddr)->cme_refcount;
+	spinlock_release(&coremap_lock);
+	return n;
+}
+
+#if !OPT_DUMBVM
+
+void
+coremap_setclean(paddr_t paddr, unsigned slot)
+{
+	struct coremap_entry *cme;
+
+	spinlock_acquire(&coremap_lock);
+	cme = coremap_uentry(paddr);
+	KASSERT(cme->cme_busy);
+	KASSERT(!cme->cme_clean);
+	cme->cme_clean = 1;
+	cme->cme_swapslot = slot;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_setdirty(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+	unsigned slot;
+	bool clean;
+
+	spinlock_acquire(&coremap_lock);
+	cme = coremap_uentry(paddr);
+	KASSERT(cme->cme_busy);
+	clean = cme->cme_clean;
+	slot = cme->cme_swapslot;
+	cme->cme_clean = 0;
+	spinlock_release(&coremap_lock);
+
+	if (clean) {
+		swap_discard(slot);
+	}
+}
+
+bool
+coremap_ismerged(paddr_t paddr)
+{
+	bool merged;
+
+	spinlock_acquire(&coremap_lock);
+	merged = coremap_uentry(paddr)->cme_merged;
+	spinlock_release(&coremap_lock);
+	return merged;
+}
+
+#endif /* !OPT_DUMBVM */
+
+void
+coremap_free(paddr_t paddr)
+{
+	unsigned frame, npages, i;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	frame = PADDR_TO_FRAME(paddr);
+
+	spinlock_acquire(&coremap_lock);
+
+	if (!coremap_ready || frame < coremap_firstfree) {
+		/* Stolen before the coremap existed; can't give it back. */
+		spinlock_release(&coremap_lock);
+		return;
+	}
+
+	KASSERT(frame < coremap_nframes);
+	if (coremap[frame].cme_state != CME_KERNEL ||
+	    coremap[frame].cme_npages == 0) {
+		panic("coremap_free: 0x%x is not the start of an allocation\n",
+		      paddr);
+	}
+
+	npages = coremap[frame].cme_npages;
+	if (npages == 1) {
+		coremap[frame].cme_state = CME_CPU;
+		spinlock_release(&coremap_lock);
+		coremap_cpuput(frame);
+		return;
+	}
+
+	KASSERT(frame + npages <= coremap_nframes);
+	for (i=frame; i<frame+npages; i++) {
+		KASSERT(coremap[i].cme_state == CME_KERNEL);
+		KASSERT(i == frame || coremap[i].cme_npages == 0);
+		coremap[i].cme_state = CME_FREE;
+		coremap[i].cme_npages = 0;
+	}
+	coremap_freerange(frame, npages);
+	coremap_nfree += npages;
+
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Add up the frames in cpu caches. Used with cpu_foreach.
+ */
+static
+void
+coremap_cpucount(struct cpu *c, void *data)
+{
+	unsigned *n = data;
+
+	spinlock_acquire(&c->c_framelock);
+	*n += c->c_nfreeframes;
+	spinlock_release(&c->c_framelock);
+}
+
+unsigned
+coremap_freecount(void)
+{
+	unsigned n;
+
+	n = 0;
+	cpu_foreach(coremap_cpucount, &n);
+
+	spinlock_acquire(&coremap_lock);
+	n += coremap_nfree + coremap_nzero;
+	spinlock_release(&coremap_lock);
+	return n;
+}
+
+/*
+ * Pin the unpinned user frame CME for coremap_pin or
+ * coremap_preloadpin. RECENT says whether this counts as a use.
+ */
+static
+void
+coremap_pinentry(struct coremap_entry *cme, struct addrspace *as,
+		 vaddr_t vaddr, bool recent)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(!cme->cme_busy);
+
+	cme->cme_busy = 1;
+	if (recent) {
+		cme->cme_recent = 1;
+	}
+	if (cme->cme_refcount == 1) {
+		cme->cme_as = as;
+		cme->cme_vaddr = vaddr;
+	}
+}
+
+bool
+coremap_pin(pte_t *pte, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *cme;
+	pte_t snap;
+
+	spinlock_acquire(&coremap_lock);
+	while (1) {
+		/*
+		 * Page-out only changes the PTE while the frame is
+		 * busy, so if it isn't, the PTE is current.
+		 */
+		snap = *pte;
+		if ((snap & PTE_VALID) == 0) {
+			spinlock_release(&coremap_lock);
+			return false;
+		}
+		cme = coremap_uentry(snap & PTE_FRAME);
+		if (!cme->cme_busy) {
+			break;
+		}
+		wchan_lock(coremap_wchan);
+		spinlock_release(&coremap_lock);
+		wchan_sleep(coremap_wchan);
+		spinlock_acquire(&coremap_lock);
+	}
+
+	coremap_pinentry(cme, as, vaddr, true);
+	*pte &= ~PTE_NOREFILL;
+	spinlock_release(&coremap_lock);
+	return true;
+}
+
+/*
+ * Nothing has touched a preloaded page, so this doesn't count as a
+ * use: the frame isn't marked recent, and a PTE the clock hand has
+ * set PTE_NOREFILL on is left for the owner's next real miss.
+ */
+bool
+coremap_preloadpin(pte_t *pte, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *cme;
+	pte_t snap;
+	bool ok;
+
+	spinlock_acquire(&coremap_lock);
+	snap = *pte;
+	ok = false;
+	if ((snap & (PTE_VALID | PTE_NOREFILL)) == PTE_VALID) {
+		cme = coremap_uentry(snap & PTE_FRAME);
+		if (!cme->cme_busy) {
+			coremap_pinentry(cme, as, vaddr, false);
+			ok = true;
+		}
+	}
+	spinlock_release(&coremap_lock);
+	return ok;
+}
+
+void
+coremap_unpin(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+
+	spinlock_acquire(&coremap_lock);
+	cme = coremap_uentry(paddr);
+	KASSERT(cme->cme_busy);
+	cme->cme_busy = 0;
+	wchan_wakeall(coremap_wchan);
+	spinlock_release(&coremap_lock);
+}
+
+bool
+coremap_zeroidle(void)
+{
+	paddr_t pa;
+
+	spinlock_acquire(&coremap_lock);
+	/*
+	 * Leave at least a pool's worth of plain free frames, so that
+	 * kernel allocations don't keep draining what we zero.
+	 */
+	if (!coremap_ready ||
+	    coremap_nzero + coremap_nzeroing >= COREMAP_ZEROPOOL ||
+	    coremap_nfree <= COREMAP_ZEROPOOL) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	pa = coremap_claim(1, CME_ZERO);
+	KASSERT(pa != 0);
+	coremap_nzeroing++;
+	spinlock_release(&coremap_lock);
+
+	bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+
+	spinlock_acquire(&coremap_lock);
+	coremap_nzeroing--;
+	KASSERT(coremap_nzero < COREMAP_ZEROPOOL);
+	coremap_zeropool[coremap_nzero++] = PADDR_TO_FRAME(pa);
+	spinlock_release(&coremap_lock);
+	return true;
+}
+
+void
+coremap_printstats(void)
+{
+	unsigned nblocks[COREMAP_NORDERS], nallocs[COREMAP_NORDERS];
+	unsigned nfails[COREMAP_NORDERS], nsplits[COREMAP_NORDERS];
+	unsigned nmerges[COREMAP_NORDERS];
+	unsigned nframes, nfree, k;
+
+	/* Take a snapshot, so as not to print with the lock held. */
+	spinlock_acquire(&coremap_lock);
+	nframes = coremap_nframes - coremap_firstfree;
+	nfree = coremap_nfree;
+	for (k=0; k<COREMAP_NORDERS; k++) {
+		nblocks[k] = coremap_nblocks[k];
+		nallocs[k] = coremap_nallocs[k];
+		nfails[k] = coremap_nfails[k];
+		nsplits[k] = coremap_nsplits[k];
+		nmerges[k] = coremap_nmerges[k];
+	}
+	spinlock_release(&coremap_lock);
+
+	kprintf("coremap: %u managed frames, %u on the free lists\n",
+		nframes, nfree);
+	kprintf("order  pages  free blocks    allocs     fails    splits"
+		"    merges\n");
+	for (k=0; k<COREMAP_NORDERS; k++) {
+		kprintf("%5u  %5u  %11u  %8u  %8u  %8u  %8u\n", k, 1U << k,
+			nblocks[k], nallocs[k], nfails[k], nsplits[k],
+			nmerges[k]);
+	}
+}
+
+#if !OPT_DUMBVM
+
+/*
+ * Same-page merging.
+ *
+ * Many processes running the same program end up with private pages
+ * that hold the same thing, zero pages especially. When turned on, a
+ * scanner thread walks the user frames a few at a time and merges such
+ * pages into one frame shared copy-on-write, exactly as if the
+ * processes had forked from one another; the first write to a merged
+ * page gets its own copy again through vm_copyonwrite.
+ *
+ * Only pageable frames are looked at: private pages with one mapping
+ * and a known owner. A frame's contents are hashed on each pass and
+ * only considered once the hash stays the same from one pass to the
+ * next, so pages being actively written are left alone. Stable frames
+ * are entered in a small hash table, one per bucket; a later stable
+ * frame with the same hash is compared against the one there, and
+ * merged into it if the contents match.
+ *
+ * To compare, both frames are pinned and their mappings made read-only
+ * first, so neither can change underfoot. If they turn out different,
+ * they are just left read-only; the next write faults and vm_fault
+ * gives write permission back.
+ */
+
+/* Buckets in the stable frame table */
+#define COREMAP_KSMBUCKETS	1024
+
+/* Frames scanned per second */
+#define COREMAP_KSMSCAN		256
+
+static bool coremap_ksmon;		/* scanner turned on */
+static bool coremap_ksmstarted;		/* scanner thread exists */
+static unsigned coremap_ksmhand;	/* next frame to scan */
+static unsigned coremap_ksmtable[COREMAP_KSMBUCKETS];	/* frame or 0 */
+
+/*
+ * Hash the contents of FRAME (FNV-1a, a word at a time).
+ */
+static
+uint32_t
+coremap_hashframe(unsigned frame)
+{
+	const uint32_t *p;
+	uint32_t h;
+	unsigned i;
+
+	p = (const uint32_t *)PADDR_TO_KVADDR(FRAME_TO_PADDR(frame));
+	h = 2166136261U;
+	for (i=0; i<PAGE_SIZE/sizeof(uint32_t); i++) {
+		h = (h ^ p[i]) * 16777619U;
+	}
+	return h;
+}
+
+static
+bool
+coremap_sameframe(unsigned f1, unsigned f2)
+{
+	const uint32_t *p1, *p2;
+	unsigned i;
+
+	p1 = (const uint32_t *)PADDR_TO_KVADDR(FRAME_TO_PADDR(f1));
+	p2 = (const uint32_t *)PADDR_TO_KVADDR(FRAME_TO_PADDR(f2));
+	for (i=0; i<PAGE_SIZE/sizeof(uint32_t); i++) {
+		if (p1[i] != p2[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Take write permission away from the page VADDR of AS, which is
+ * mapped by the pinned frame PADDR, and keep the owner from reloading
+ * even a read-only entry without the pin, since we may be about to
+ * point the PTE elsewhere. Returns the PTE.
+ */
+static
+pte_t *
+coremap_ksmprotect(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
+{
+	pte_t *pte;
+
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	KASSERT(pte != NULL);
+	KASSERT((*pte & (PTE_FRAME | PTE_VALID)) == (paddr | PTE_VALID));
+	*pte = (*pte & ~PTE_WRITE) | PTE_NOREFILL;
+	vm_tlb_revoke(&as->as_tlb, vaddr);
+	return pte;
+}
+
+/*
+ * Look at one frame, and merge it with an identical one if we know of
+ * one.
+ */
+static
+void
+coremap_ksmscan(unsigned frame)
+{
+	struct coremap_entry *cme, *other;
+	struct addrspace *as, *otheras;
+	vaddr_t vaddr, othervaddr;
+	pte_t *pte, *otherpte;
+	unsigned bucket, otherframe;
+	uint32_t hash;
+	bool stable;
+
+	spinlock_acquire(&coremap_lock);
+	cme = &coremap[frame];
+	if (!COREMAP_PAGEABLE(cme)) {
+		spinlock_release(&coremap_lock);
+		return;
+	}
+	/* Pinning it keeps the owner from going away. */
+	cme->cme_busy = 1;
+	as = cme->cme_as;
+	vaddr = cme->cme_vaddr;
+	spinlock_release(&coremap_lock);
+
+	hash = coremap_hashframe(frame);
+
+	spinlock_acquire(&coremap_lock);
+	stable = cme->cme_hash == hash;
+	cme->cme_hash = hash;
+	bucket = hash % COREMAP_KSMBUCKETS;
+	otherframe = coremap_ksmtable[bucket];
+	other = &coremap[otherframe];
+	if (!stable || otherframe == frame) {
+		goto unpin;
+	}
+
+	/*
+	 * The one in the table may have been freed or changed since.
+	 * It has to be a private page as above, or already merged.
+	 */
+	if (otherframe == 0 || other->cme_state != CME_USER ||
+	    other->cme_busy || other->cme_hash != hash ||
+	    (other->cme_merged ? other->cme_refcount == 0xffff :
+	     !COREMAP_PAGEABLE(other))) {
+		coremap_ksmtable[bucket] = frame;
+		goto unpin;
+	}
+	other->cme_busy = 1;
+	otheras = other->cme_merged ? NULL : other->cme_as;
+	othervaddr = other->cme_vaddr;
+	spinlock_release(&coremap_lock);
+
+	/* Merged frames are already mapped read-only everywhere. */
+	otherpte = NULL;
+	if (otheras != NULL) {
+		otherpte = coremap_ksmprotect(otheras, othervaddr,
+					      FRAME_TO_PADDR(otherframe));
+	}
+	pte = coremap_ksmprotect(as, vaddr, FRAME_TO_PADDR(frame));
+
+	if (!coremap_sameframe(frame, otherframe)) {
+		spinlock_acquire(&coremap_lock);
+		other->cme_busy = 0;
+		goto unpin;
+	}
+
+	*pte = FRAME_TO_PADDR(otherframe) | PTE_VALID | PTE_COW;
+	if (otherpte != NULL) {
+		*otherpte |= PTE_COW;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	other->cme_refcount++;
+	other->cme_merged = 1;
+	other->cme_as = NULL;
+	other->cme_vaddr = 0;
+	other->cme_busy = 0;
+	wchan_wakeall(coremap_wchan);
+	spinlock_release(&coremap_lock);
+
+	/*
+	 * Nothing maps this one any more; freeing it drops our pin.
+	 * (Unpinning first would let the daemon try to page it out.)
+	 */
+	coremap_decref(FRAME_TO_PADDR(frame));
+	vmstats_inc(VMSTAT_KSM_MERGED);
+	return;
+
+ unpin:
+	cme->cme_busy = 0;
+	wchan_wakeall(coremap_wchan);
+	spinlock_release(&coremap_lock);
+}
+
+static
+void
+coremap_ksmd(void *data1, unsigned long data2)
+{
+	unsigned n, frame;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(1);
+		if (!coremap_ksmon) {
+			continue;
+		}
+		for (n=0; n<COREMAP_KSMSCAN; n++) {
+			frame = coremap_ksmhand++;
+			if (coremap_ksmhand == coremap_nframes) {
+				coremap_ksmhand = coremap_firstfree;
+			}
+			coremap_ksmscan(frame);
+		}
+	}
+}
+
+void
+coremap_setksm(bool on)
+{
+	int result;
+
+	KASSERT(coremap_ready);
+
+	if (on && !coremap_ksmstarted) {
+		coremap_ksmhand = coremap_firstfree;
+		result = thread_fork("ksmd", NULL, coremap_ksmd, NULL, 0);
+		if (result) {
+			kprintf("coremap: cannot start ksmd: %s\n",
+				strerror(result));
+			return;
+		}
+		coremap_ksmstarted = true;
+	}
+	coremap_ksmon = on;
+}
+
+bool
+coremap_getksm(void)
+{
+	return coremap_ksmon;
+}
+
+#endif /* !OPT_DUMBVM */
@@ -30,7 +30,10 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <kmemcache.h>
 
 /*
  * Kernel malloc.
@@ -75,6 +78,12 @@ fill_deadbeef(void *vptr, size_t len)
 //    cannot recursively use the subpage allocator. (We could probably
 //    make that work, but it would be painful.)
 //
+//    To find the pageref for a pointer being freed, there is a direct
+//    map from physical page number to pageref (see below), which is
+//    NULL for pages that aren't subpage pages. The per-size lists are
+//    doubly linked, so a page can come off its list in constant time
+//    too.
+//
 
 #undef  SLOW	/* consistency checks */
 #undef SLOWER	/* lots of consistency checks */
@@ -83,8 +92,18 @@ fill_deadbeef(void *vptr, size_t len)
 
 #if PAGE_SIZE == 4096
 
-#define NSIZES 8
-static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+/*
+ * Besides the powers of two, there are classes sized for what the
+ * kernel allocates most: short names (24), regions (48), trapframes
+ * (152), and sfs_vnodes and filetables (544). The rest fill the gaps
+ * where they fit noticeably more blocks on a page. Threads, procs and
+ * synch objects have object caches of their own (see kmemcache.h).
+ */
+#define NSIZES 15
+static const size_t sizes[NSIZES] = {
+	16, 24, 32, 48, 64, 96, 128, 152, 192, 256, 384, 512, 544,
+	1024, 2048
+};
 
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
@@ -103,7 +122,7 @@ struct freelist {
 
 struct pageref {
 	struct pageref *next_samesize;
-	struct pageref *next_all;
+	struct pageref **pprev_samesize;	/* what points to us */
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -118,85 +137,221 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
+ * Pagerefs come a page of them at a time from alloc_kpages, as many
+ * pages as it takes, so the subpage allocator can use all of memory.
+ * Like the map leaves below, these pages are never given back; a page
+ * of pagerefs manages a megabyte of heap, so that's not much to keep.
  *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Free pagerefs are kept on a list threaded through next_samesize, so
+ * getting and releasing one takes constant time. The list and counts
+ * are protected by kmalloc_spinlock.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+#define PAGEREFS_PERPAGE (PAGE_SIZE / sizeof(struct pageref))
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+static struct pageref *pagerefs_free;
+static unsigned pagerefs_total;		/* pagerefs in all */
+static unsigned pagerefs_inuse;		/* ...of which not on the free list */
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pageref *pr;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
+	pr = pagerefs_free;
+	if (pr == NULL) {
+		/* ran out; see pagerefs_grow */
+		return NULL;
 	}
-
-	/* ran out */
-	return NULL;
+	pagerefs_free = pr->next_samesize;
+	pagerefs_inuse++;
+	return pr;
 }
 
 static
 void
-freepageref(struct pageref *p)
+freepageref(struct pageref *pr)
 {
-	size_t i, j;
-	uint32_t k;
-
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	KASSERT(pagerefs_inuse > 0);
+	pagerefs_inuse--;
+	pr->pageaddr_and_blocktype = 0;
+	pr->pprev_samesize = NULL;
+	pr->next_samesize = pagerefs_free;
+	pagerefs_free = pr;
 }
 
 ////////////////////////////////////////
 
 static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
 
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Page number to pageref map, for kfree.
+ *
+ * This is a two-level table indexed by physical page number, like a
+ * page table: each leaf is a page of pointers covering 4M of physical
+ * memory, and is only allocated once a subpage page turns up in that
+ * range. Leaves are never freed. A machine with a few megabytes of RAM
+ * needs one or two.
+ *
+ * Leaves are installed, and entries changed, under kmalloc_spinlock.
  */
 
+#define PRMAP_LEAFENTRIES  (PAGE_SIZE / sizeof(struct pageref *))
+#define PRMAP_NLEAVES \
+	((MIPS_KSEG1 - MIPS_KSEG0) / PAGE_SIZE / PRMAP_LEAFENTRIES)
+
+#define PRMAP_PAGENUM(va)  (KVADDR_TO_PADDR(va) / PAGE_SIZE)
+#define PRMAP_LEAF(va)     (PRMAP_PAGENUM(va) / PRMAP_LEAFENTRIES)
+#define PRMAP_INDEX(va)    (PRMAP_PAGENUM(va) % PRMAP_LEAFENTRIES)
+
+static struct pageref **pagerefmap[PRMAP_NLEAVES];
+
+////////////////////////////////////////
+
+/*
+ * Use one spinlock for the pages and their freelists. Most allocations
+ * and frees don't get this far, though: each cpu keeps a magazine of
+ * free blocks of each size (see struct cpu), and only goes to the
+ * pages to refill or empty it, KMAG_BATCH blocks at a time. Blocks in
+ * a magazine look allocated as far as their page is concerned.
+ *
+ * The magazine lock comes before kmalloc_spinlock.
+ */
+
+#define KMAG_BATCH  (CPU_KMAGSIZE / 2)
+
+#if NSIZES > CPU_KMALLOCSIZES
+#error "CPU_KMALLOCSIZES is too small"
+#endif
+
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+/*
+ * Internal fragmentation: for each size class, blocks handed out and
+ * the bytes in them beyond what was asked for, since boot. Blocks from
+ * a magazine are counted in the cpu's own counters, under its lock;
+ * these are for the rest, under kmalloc_spinlock.
+ */
+static unsigned kmalloc_nallocs[NSIZES];
+static uint64_t kmalloc_slack[NSIZES];
+
+////////////////////////////////////////
+
+/*
+ * Return the pageref for the subpage page containing ADDR, or NULL if
+ * it isn't one (e.g. a multi-page allocation).
+ *
+ * This needs kmalloc_spinlock in general, but not if ADDR is a block
+ * or multi-page allocation the caller owns: its page can't change
+ * hands until the caller frees it, and leaves never go away.
+ */
+static
+struct pageref *
+pagerefmap_get(vaddr_t addr)
+{
+	struct pageref **leaf;
+
+	if (addr < MIPS_KSEG0 || addr >= MIPS_KSEG1) {
+		return NULL;
+	}
+	leaf = pagerefmap[PRMAP_LEAF(addr)];
+	if (leaf == NULL) {
+		return NULL;
+	}
+	return leaf[PRMAP_INDEX(addr)];
+}
+
+static
+void
+pagerefmap_set(vaddr_t page, struct pageref *pr)
+{
+	struct pageref **leaf;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	leaf = pagerefmap[PRMAP_LEAF(page)];
+	KASSERT(leaf != NULL);
+	leaf[PRMAP_INDEX(page)] = pr;
+}
+
+/*
+ * Make sure there's a map leaf covering PAGE. Called without the
+ * spinlock, since it may need to allocate one. Returns false if it
+ * can't.
+ */
+static
+bool
+pagerefmap_prepare(vaddr_t page)
+{
+	struct pageref **leaf;
+	vaddr_t leafpage;
+	unsigned i;
+
+	KASSERT(page >= MIPS_KSEG0 && page < MIPS_KSEG1);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	leaf = pagerefmap[PRMAP_LEAF(page)];
+	spinlock_release(&kmalloc_spinlock);
+	if (leaf != NULL) {
+		return true;
+	}
+
+	leafpage = alloc_kpages(1);
+	if (leafpage == 0) {
+		return false;
+	}
+	leaf = (struct pageref **)leafpage;
+	for (i=0; i<PRMAP_LEAFENTRIES; i++) {
+		leaf[i] = NULL;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (pagerefmap[PRMAP_LEAF(page)] == NULL) {
+		pagerefmap[PRMAP_LEAF(page)] = leaf;
+		leaf = NULL;
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Someone else got there first. */
+	if (leaf != NULL) {
+		free_kpages(leafpage);
+	}
+	return true;
+}
+
+/*
+ * Add a page of free pagerefs. Called without the spinlock, since it
+ * allocates. Returns false if it can't.
+ */
+static
+bool
+pagerefs_grow(void)
+{
+	struct pageref *prs;
+	vaddr_t prspage;
+	unsigned i;
+
+	prspage = alloc_kpages(1);
+	if (prspage == 0) {
+		return false;
+	}
+	prs = (struct pageref *)prspage;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<PAGEREFS_PERPAGE; i++) {
+		prs[i].pageaddr_and_blocktype = 0;
+		prs[i].pprev_samesize = NULL;
+		prs[i].next_samesize = pagerefs_free;
+		pagerefs_free = &prs[i];
+	}
+	pagerefs_total += PAGEREFS_PERPAGE;
+	spinlock_release(&kmalloc_spinlock);
+	return true;
+}
+
 ////////////////////////////////////////
 
 /* SLOWER implies SLOW */
@@ -253,25 +408,27 @@ checksubpages(void)
 {
 	struct pageref *pr;
 	int i;
-	unsigned sc=0, ac=0;
+	unsigned sc=0, fc=0;
 
 	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(*pr->pprev_samesize == pr);
+			KASSERT(pagerefmap_get(PR_PAGEADDR(pr)) == pr);
+			KASSERT(sc < pagerefs_inuse);
 			sc++;
 		}
 	}
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
-		ac++;
+	for (pr = pagerefs_free; pr != NULL; pr = pr->next_samesize) {
+		KASSERT(fc < pagerefs_total - pagerefs_inuse);
+		fc++;
 	}
 
-	KASSERT(sc==ac);
+	KASSERT(sc == pagerefs_inuse);
+	KASSERT(fc == pagerefs_total - pagerefs_inuse);
 }
 #else
 #define checksubpages() 
@@ -330,21 +487,106 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+/* Per-class totals over all cpus, for kheap_printstats */
+struct kmag_totals {
+	unsigned kt_nkmag[NSIZES];
+	unsigned kt_nallocs[NSIZES];
+	uint64_t kt_slack[NSIZES];
+};
+
+/*
+ * Print how many blocks cpu C has cached, and add its counts to the
+ * kmag_totals in DATA. Used with cpu_foreach.
+ */
+static
+void
+kmag_printstats(struct cpu *c, void *data)
+{
+	struct kmag_totals *kt = data;
+	unsigned i;
+
+	spinlock_acquire(&c->c_kmalloclock);
+	kprintf("cpu%u magazines:", c->c_number);
+	for (i=0; i<NSIZES; i++) {
+		kprintf(" %lu:%u", (unsigned long)sizes[i], c->c_nkmag[i]);
+		kt->kt_nkmag[i] += c->c_nkmag[i];
+		kt->kt_nallocs[i] += c->c_kmallocs[i];
+		kt->kt_slack[i] += c->c_kslack[i];
+	}
+	kprintf("\n");
+	spinlock_release(&c->c_kmalloclock);
+}
+
+/*
+ * Print, for each size class, the blocks in use and the internal
+ * fragmentation: the bytes allocated beyond what callers asked for,
+ * in total since boot, and an estimate of how much of that is tied up
+ * now (blocks in use times the average slack per block).
+ */
+static
+void
+kheap_printsizes(struct kmag_totals *kt)
+{
+	struct pageref *pr;
+	unsigned i, inuse, nallocs;
+	uint64_t slack;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	kprintf("Size classes:\n");
+	for (i=0; i<NSIZES; i++) {
+		inuse = 0;
+		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
+			inuse += PAGE_SIZE / sizes[i] - pr->nfree;
+		}
+		/* magazines may have changed since; don't go negative */
+		inuse = inuse > kt->kt_nkmag[i] ? inuse - kt->kt_nkmag[i] : 0;
+		nallocs = kt->kt_nallocs[i] + kmalloc_nallocs[i];
+		slack = kt->kt_slack[i] + kmalloc_slack[i];
+
+		kprintf("  %4lu: %u in use, %u allocs, %llu bytes slack, "
+			"~%llu now\n", (unsigned long)sizes[i], inuse, nallocs,
+			(unsigned long long)slack,
+			nallocs == 0 ? 0ULL :
+			(unsigned long long)(slack * inuse / nallocs));
+	}
+}
+
 void
 kheap_printstats(void)
 {
+	struct kmag_totals kt;
 	struct pageref *pr;
+	unsigned i;
+
+	for (i=0; i<NSIZES; i++) {
+		kt.kt_nkmag[i] = 0;
+		kt.kt_nallocs[i] = 0;
+		kt.kt_slack[i] = 0;
+	}
+
+	/* Blocks in magazines show up below as allocated. */
+	if (CURCPU_EXISTS()) {
+		cpu_foreach(kmag_printstats, &kt);
+	}
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
-	kprintf("Subpage allocator status:\n");
+	kprintf("Subpage allocator status: %u pages, %u pagerefs\n",
+		pagerefs_inuse, pagerefs_total);
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		dumpsubpage(pr);
+	for (i=0; i<NSIZES; i++) {
+		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
+			dumpsubpage(pr);
+		}
 	}
 
+	kheap_printsizes(&kt);
+
 	spinlock_release(&kmalloc_spinlock);
+
+	kmem_cache_printstats();
 }
 
 ////////////////////////////////////////
@@ -353,25 +595,14 @@ static
 void
 remove_lists(struct pageref *pr, int blktype)
 {
-	struct pageref **guy;
-
 	KASSERT(blktype>=0 && blktype<NSIZES);
+	KASSERT(*pr->pprev_samesize == pr);
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
-	}
-
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
+	*pr->pprev_samesize = pr->next_samesize;
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->pprev_samesize = pr->pprev_samesize;
 	}
+	pagerefmap_set(PR_PAGEADDR(pr), NULL);
 }
 
 static
@@ -392,26 +623,54 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take a block off the freelist of PR, which must have one.
+ */
 static
 void *
-subpage_kmalloc(size_t sz)
+subpage_takeblock(struct pageref *pr)
 {
-	unsigned blktype;	// index into sizes[] that we're using
-	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
+	struct freelist *fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
 
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
 
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
 
-	spinlock_acquire(&kmalloc_spinlock);
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+	return retptr;
+}
 
-	checksubpages();
+/*
+ * Find a free block of type BLKTYPE on the pages we already have, or
+ * return NULL.
+ */
+static
+void *
+subpage_findblock(unsigned blktype)
+{
+	struct pageref *pr;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
 
@@ -420,34 +679,88 @@ subpage_kmalloc(size_t sz)
 		checksubpage(pr);
 
 		if (pr->nfree > 0) {
+			return subpage_takeblock(pr);
+		}
+	}
+	return NULL;
+}
 
-		doalloc: /* comes here after getting a whole fresh page */
+/*
+ * Put block PTR back on the freelist of its page PR. If that empties
+ * the page, returns it for the caller to free_kpages once it has let
+ * go of the spinlock; otherwise 0.
+ */
+static
+vaddr_t
+subpage_putblock(struct pageref *pr, void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = (vaddr_t)ptr - prpage;
 
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	KASSERT(offset < PAGE_SIZE);
+	checksubpage(pr);
 
-			checksubpages();
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
 
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
-		}
+	fl = (struct freelist *)ptr;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		freepageref(pr);
+		return prpage;
+	}
+	return 0;
+}
+
+static
+void *
+subpage_kmalloc(size_t sz)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	struct pageref *pr;	// pageref for page we're allocating from
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+	void *retptr;		// our result
+
+	volatile int i;
+
+
+	blktype = blocktype(sz);
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	retptr = subpage_findblock(blktype);
+	if (retptr != NULL) {
+		kmalloc_nallocs[blktype]++;
+		kmalloc_slack[blktype] += sizes[blktype] - sz;
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		return retptr;
 	}
 
 	/*
@@ -466,15 +779,22 @@ subpage_kmalloc(size_t sz)
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
 		return NULL;
 	}
+	if (!pagerefmap_prepare(prpage)) {
+		free_kpages(prpage);
+		kprintf("kmalloc: Subpage allocator couldn't map a page\n");
+		return NULL;
+	}
 	spinlock_acquire(&kmalloc_spinlock);
 
-	pr = allocpageref();
-	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
+	while ((pr = allocpageref()) == NULL) {
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		if (!pagerefs_grow()) {
+			/* Couldn't allocate accounting space for the new page. */
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
+			return NULL;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -499,100 +819,177 @@ subpage_kmalloc(size_t sz)
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
 	pr->next_samesize = sizebases[blktype];
+	pr->pprev_samesize = &sizebases[blktype];
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->pprev_samesize = &pr->next_samesize;
+	}
 	sizebases[blktype] = pr;
 
-	pr->next_all = allbase;
-	allbase = pr;
+	pagerefmap_set(prpage, pr);
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	retptr = subpage_takeblock(pr);
+	kmalloc_nallocs[blktype]++;
+	kmalloc_slack[blktype] += sizes[blktype] - sz;
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+	return retptr;
 }
 
+/*
+ * Free block PTR of page PR.
+ */
 static
-int
-subpage_kfree(void *ptr)
+void
+subpage_kfree(struct pageref *pr, void *ptr)
 {
-	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr;	// pageref for page we're freeing in
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
-	vaddr_t offset;		// offset into page
-
-	ptraddr = (vaddr_t)ptr;
+	vaddr_t freepage;
 
 	spinlock_acquire(&kmalloc_spinlock);
-
 	checksubpages();
+	KASSERT(pagerefmap_get((vaddr_t)ptr) == pr);
+	freepage = subpage_putblock(pr, ptr);
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
+	if (freepage != 0) {
+		free_kpages(freepage);
+	}
+}
 
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
+////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+
+/*
+ * Give blocks from the magazine for BLKTYPE on cpu C back to their
+ * pages until KEEP are left. Pages that empty are freed.
+ */
+static
+void
+kmag_drain(struct cpu *c, unsigned blktype, unsigned keep)
+{
+	vaddr_t freepages[CPU_KMAGSIZE];
+	unsigned nfreepages, i;
+	struct pageref *pr;
+	void *ptr;
+
+	KASSERT(spinlock_do_i_hold(&c->c_kmalloclock));
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
+	nfreepages = 0;
+	spinlock_acquire(&kmalloc_spinlock);
+	while (c->c_nkmag[blktype] > keep) {
+		ptr = c->c_kmag[blktype][--c->c_nkmag[blktype]];
+		pr = pagerefmap_get((vaddr_t)ptr);
+		KASSERT(pr != NULL && PR_BLOCKTYPE(pr) == blktype);
+		freepages[nfreepages] = subpage_putblock(pr, ptr);
+		if (freepages[nfreepages] != 0) {
+			nfreepages++;
 		}
 	}
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
 
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
-		return -1;
+	/*
+	 * free_kpages wants no spinlocks held at all, so let go of the
+	 * magazine too.
+	 */
+	if (nfreepages > 0) {
+		spinlock_release(&c->c_kmalloclock);
+		for (i=0; i<nfreepages; i++) {
+			free_kpages(freepages[i]);
+		}
+		spinlock_acquire(&c->c_kmalloclock);
 	}
+}
 
-	offset = ptraddr - prpage;
+/*
+ * Empty every magazine of one cpu. Used with cpu_foreach when memory
+ * runs out, so that blocks sitting in magazines don't keep whole
+ * pages tied up.
+ */
+static
+void
+kmag_flush(struct cpu *c, void *data)
+{
+	unsigned i;
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
-	}
+	(void)data;
 
-	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
-	 */
-	fill_deadbeef(ptr, sizes[blktype]);
+	spinlock_acquire(&c->c_kmalloclock);
+	for (i=0; i<NSIZES; i++) {
+		kmag_drain(c, i, 0);
+	}
+	spinlock_release(&c->c_kmalloclock);
+}
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+/*
+ * Get a block of type BLKTYPE from this cpu's magazine, for a request
+ * of SZ bytes, refilling it from the pages we already have if it's
+ * empty. Returns NULL if there are none, or no cpus yet.
+ */
+static
+void *
+kmag_alloc(unsigned blktype, size_t sz)
+{
+	struct cpu *c;
+	void *ptr;
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	if (!CURCPU_EXISTS()) {
+		return NULL;
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
+	/*
+	 * If we move to another cpu after reading curcpu, we just use
+	 * the old one's magazine; it's protected by its lock either way.
+	 */
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_kmalloclock);
+	if (c->c_nkmag[blktype] == 0) {
+		spinlock_acquire(&kmalloc_spinlock);
+		while (c->c_nkmag[blktype] < KMAG_BATCH) {
+			ptr = subpage_findblock(blktype);
+			if (ptr == NULL) {
+				break;
+			}
+			c->c_kmag[blktype][c->c_nkmag[blktype]++] = ptr;
+		}
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+	ptr = NULL;
+	if (c->c_nkmag[blktype] > 0) {
+		ptr = c->c_kmag[blktype][--c->c_nkmag[blktype]];
+		c->c_kmallocs[blktype]++;
+		c->c_kslack[blktype] += sizes[blktype] - sz;
 	}
+	spinlock_release(&c->c_kmalloclock);
+	return ptr;
+}
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
-#endif
+/*
+ * Put block PTR of type BLKTYPE in this cpu's magazine, first giving
+ * a batch back to the pages if it's full. Returns false if there are
+ * no cpus yet.
+ */
+static
+bool
+kmag_free(unsigned blktype, void *ptr)
+{
+	struct cpu *c;
 
-	return 0;
+	if (!CURCPU_EXISTS()) {
+		return false;
+	}
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_kmalloclock);
+	/* Draining may let go of the lock, so check again after. */
+	while (c->c_nkmag[blktype] == CPU_KMAGSIZE) {
+		kmag_drain(c, blktype, CPU_KMAGSIZE - KMAG_BATCH);
+	}
+	c->c_kmag[blktype][c->c_nkmag[blktype]++] = ptr;
+	spinlock_release(&c->c_kmalloclock);
+	return true;
 }
 
 //
@@ -601,6 +998,8 @@ subpage_kfree(void *ptr)
 void *
 kmalloc(size_t sz)
 {
+	void *ptr;
+
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
@@ -608,6 +1007,11 @@ kmalloc(size_t sz)
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
+		if (address==0 && CURCPU_EXISTS()) {
+			/* Shake loose any pages held up by magazines. */
+			cpu_foreach(kmag_flush, NULL);
+			address = alloc_kpages(npages);
+		}
 		if (address==0) {
 			return NULL;
 		}
@@ -615,20 +1019,52 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
-	return subpage_kmalloc(sz);
+	ptr = kmag_alloc(blocktype(sz), sz);
+	if (ptr == NULL) {
+		ptr = subpage_kmalloc(sz);
+	}
+	if (ptr == NULL && CURCPU_EXISTS()) {
+		cpu_foreach(kmag_flush, NULL);
+		ptr = subpage_kmalloc(sz);
+	}
+	return ptr;
 }
 
 void
 kfree(void *ptr)
 {
-	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
-	 */
+	struct pageref *pr;
+	vaddr_t ptraddr, offset;
+	int blktype;
+
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
-		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
-		free_kpages((vaddr_t)ptr);
 	}
-}
 
+	ptraddr = (vaddr_t)ptr;
+	pr = pagerefmap_get(ptraddr);
+	if (pr == NULL) {
+		/* Not on any of our pages - assume it's a big allocation. */
+		KASSERT(ptraddr%PAGE_SIZE==0);
+		free_kpages(ptraddr);
+		return;
+	}
+
+	/* Check for proper positioning and alignment */
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	offset = ptraddr - PR_PAGEADDR(pr);
+	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	if (!kmag_free(blktype, ptr)) {
+		subpage_kfree(pr, ptr);
+	}
+}
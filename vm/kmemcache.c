@@ -0,0 +1,258 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmemcache.h>
+
+/*
+ * Object caches (see <kmemcache.h>).
+ *
+ * Each slab is one page from alloc_kpages, with a header at the start
+ * and the objects after it; an object's slab is found by masking off
+ * the page offset. Objects stay constructed while free, so the free
+ * list can't be threaded through them: each slot has a link word after
+ * the object, and slots are rounded up to 8 bytes to keep objects as
+ * aligned as kmalloc's.
+ *
+ * Slabs with free objects are on the cache's partial list; full ones
+ * aren't on any list until something in them is freed. One entirely
+ * free slab is kept per cache, so a create/destroy cycle doesn't have
+ * to set up a slab and tear it down again every time.
+ */
+
+/* Entirely free slabs each cache keeps */
+#define KMEM_MAXEMPTY  1
+
+struct kmem_slab {
+	struct kmem_cache *ks_cache;
+	struct kmem_slab *ks_next;		/* partial list */
+	struct kmem_slab **ks_pprev;		/* ...what points to us */
+	void *ks_free;				/* first free object */
+	unsigned ks_nfree;
+	unsigned ks_nobjs;
+};
+
+#define KMEM_HDRSIZE	((sizeof(struct kmem_slab) + 7) & ~(size_t)7)
+#define KMEM_LINKOFF(kc) (((kc)->kc_size + 3) & ~(size_t)3)
+#define KMEM_SLOTSIZE(kc) ((KMEM_LINKOFF(kc) + sizeof(void *) + 7) & ~(size_t)7)
+#define KMEM_LINK(kc, obj) ((void **)((char *)(obj) + KMEM_LINKOFF(kc)))
+
+/* Caches that have been used, for kmem_cache_printstats */
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+
+static
+unsigned
+kmem_nobjs(struct kmem_cache *kc)
+{
+	return (PAGE_SIZE - KMEM_HDRSIZE) / KMEM_SLOTSIZE(kc);
+}
+
+/*
+ * Give back a slab no longer on any list, running the destructor on
+ * each object in it. All of them must be free.
+ */
+static
+void
+kmem_slab_destroy(struct kmem_cache *kc, struct kmem_slab *slab)
+{
+	void *obj;
+
+	KASSERT(slab->ks_nfree == slab->ks_nobjs);
+
+	while ((obj = slab->ks_free) != NULL) {
+		slab->ks_free = *KMEM_LINK(kc, obj);
+		if (kc->kc_dtor != NULL) {
+			kc->kc_dtor(obj);
+		}
+		slab->ks_nfree--;
+	}
+	KASSERT(slab->ks_nfree == 0);
+	free_kpages((vaddr_t)slab);
+}
+
+/*
+ * Set up a new slab, with every object in it constructed and on its
+ * free list. Called without the cache lock, since the constructor and
+ * alloc_kpages may both sleep.
+ */
+static
+struct kmem_slab *
+kmem_slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *slab;
+	vaddr_t va;
+	void *obj;
+	unsigned i;
+
+	va = alloc_kpages(1);
+	if (va == 0) {
+		return NULL;
+	}
+
+	slab = (struct kmem_slab *)va;
+	slab->ks_cache = kc;
+	slab->ks_next = NULL;
+	slab->ks_pprev = NULL;
+	slab->ks_free = NULL;
+	slab->ks_nfree = 0;
+	slab->ks_nobjs = kmem_nobjs(kc);
+	KASSERT(slab->ks_nobjs > 0);
+
+	/* Backwards, so objects are handed out in address order */
+	for (i = slab->ks_nobjs; i-- > 0; ) {
+		obj = (char *)va + KMEM_HDRSIZE + i * KMEM_SLOTSIZE(kc);
+		if (kc->kc_ctor != NULL && kc->kc_ctor(obj)) {
+			/* pretend it's complete so destroy can undo it */
+			slab->ks_nobjs = slab->ks_nfree;
+			kmem_slab_destroy(kc, slab);
+			return NULL;
+		}
+		*KMEM_LINK(kc, obj) = slab->ks_free;
+		slab->ks_free = obj;
+		slab->ks_nfree++;
+	}
+
+	return slab;
+}
+
+static
+void
+kmem_partial_insert(struct kmem_cache *kc, struct kmem_slab *slab)
+{
+	KASSERT(slab->ks_pprev == NULL);
+
+	slab->ks_next = kc->kc_partial;
+	if (slab->ks_next != NULL) {
+		slab->ks_next->ks_pprev = &slab->ks_next;
+	}
+	slab->ks_pprev = &kc->kc_partial;
+	kc->kc_partial = slab;
+}
+
+static
+void
+kmem_partial_remove(struct kmem_slab *slab)
+{
+	KASSERT(*slab->ks_pprev == slab);
+
+	*slab->ks_pprev = slab->ks_next;
+	if (slab->ks_next != NULL) {
+		slab->ks_next->ks_pprev = slab->ks_pprev;
+	}
+	slab->ks_next = NULL;
+	slab->ks_pprev = NULL;
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *slab;
+	void *obj;
+
+	spinlock_acquire(&kc->kc_lock);
+	while ((slab = kc->kc_partial) == NULL) {
+		spinlock_release(&kc->kc_lock);
+
+		slab = kmem_slab_create(kc);
+		if (slab == NULL) {
+			return NULL;
+		}
+
+		spinlock_acquire(&kmem_caches_lock);
+		if (!kc->kc_listed) {
+			kc->kc_next = kmem_caches;
+			kmem_caches = kc;
+			kc->kc_listed = true;
+		}
+		spinlock_release(&kmem_caches_lock);
+
+		spinlock_acquire(&kc->kc_lock);
+		kc->kc_nslabs++;
+		kc->kc_nempty++;
+		kmem_partial_insert(kc, slab);
+	}
+
+	KASSERT(slab->ks_nfree > 0);
+	if (slab->ks_nfree == slab->ks_nobjs) {
+		KASSERT(kc->kc_nempty > 0);
+		kc->kc_nempty--;
+	}
+
+	obj = slab->ks_free;
+	slab->ks_free = *KMEM_LINK(kc, obj);
+	slab->ks_nfree--;
+	if (slab->ks_nfree == 0) {
+		kmem_partial_remove(slab);
+	}
+	kc->kc_inuse++;
+
+	spinlock_release(&kc->kc_lock);
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *slab;
+	vaddr_t offset;
+
+	KASSERT(obj != NULL);
+
+	slab = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+	offset = (vaddr_t)obj - (vaddr_t)slab;
+	KASSERT(slab->ks_cache == kc);
+	KASSERT(offset >= KMEM_HDRSIZE);
+	KASSERT((offset - KMEM_HDRSIZE) % KMEM_SLOTSIZE(kc) == 0);
+
+	spinlock_acquire(&kc->kc_lock);
+
+	KASSERT(slab->ks_nfree < slab->ks_nobjs);
+	KASSERT(kc->kc_inuse > 0);
+
+	*KMEM_LINK(kc, obj) = slab->ks_free;
+	slab->ks_free = obj;
+	slab->ks_nfree++;
+	kc->kc_inuse--;
+	if (slab->ks_nfree == 1) {
+		kmem_partial_insert(kc, slab);
+	}
+
+	if (slab->ks_nfree == slab->ks_nobjs) {
+		kc->kc_nempty++;
+		if (kc->kc_nempty > KMEM_MAXEMPTY) {
+			kmem_partial_remove(slab);
+			kc->kc_nempty--;
+			kc->kc_nslabs--;
+			spinlock_release(&kc->kc_lock);
+			kmem_slab_destroy(kc, slab);
+			return;
+		}
+	}
+
+	spinlock_release(&kc->kc_lock);
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+	unsigned nslabs, nempty, inuse;
+
+	kprintf("Object caches:\n");
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		nslabs = kc->kc_nslabs;
+		nempty = kc->kc_nempty;
+		inuse = kc->kc_inuse;
+		spinlock_release(&kc->kc_lock);
+
+		kprintf("    %s (%u bytes): %u in use, %u free, "
+			"%u slabs (%u empty)\n", kc->kc_name,
+			(unsigned)kc->kc_size, inuse,
+			nslabs * kmem_nobjs(kc) - inuse, nslabs, nempty);
+	}
+	spinlock_release(&kmem_caches_lock);
+}
@@ -0,0 +1,208 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <lzpage.h>
+
+/*
+ * LZ77 page compression for compressed swap. See lzpage.h.
+ *
+ * Matches are found through a hash table of the last position each
+ * 4-byte string was seen at (plus one, so 0 means never), which is
+ * crude but needs no searching; pages that compress at all tend to be
+ * mostly zeros or repeated words, which it finds easily.
+ */
+
+static
+uint32_t
+lz_read32(const uint8_t *p)
+{
+	/* Byte at a time; the input needn't be aligned. */
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static
+unsigned
+lz_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASHBITS);
+}
+
+/*
+ * Write the continuation bytes for a nibble of 15 covering N more.
+ * Returns the new output position, or MAX+1 if it doesn't fit.
+ */
+static
+size_t
+lz_putlen(uint8_t *dst, size_t op, size_t max, size_t n)
+{
+	while (n >= 255) {
+		if (op >= max) {
+			return max + 1;
+		}
+		dst[op++] = 255;
+		n -= 255;
+	}
+	if (op >= max) {
+		return max + 1;
+	}
+	dst[op++] = n;
+	return op;
+}
+
+/*
+ * Write one sequence: NLIT literals from LIT, then, if MLEN isn't 0, a
+ * match of MLEN bytes at distance DIST. Returns the new output
+ * position, or MAX+1 if it doesn't fit.
+ */
+static
+size_t
+lz_putseq(uint8_t *dst, size_t op, size_t max, const uint8_t *lit,
+	  size_t nlit, size_t dist, size_t mlen)
+{
+	size_t mcode;
+
+	mcode = mlen > 0 ? mlen - LZ_MINMATCH : 0;
+	if (op >= max) {
+		return max + 1;
+	}
+	dst[op++] = ((nlit < 15 ? nlit : 15) << 4) | (mcode < 15 ? mcode : 15);
+	if (nlit >= 15) {
+		op = lz_putlen(dst, op, max, nlit - 15);
+	}
+	if (op > max || nlit > max - op) {
+		return max + 1;
+	}
+	memcpy(dst + op, lit, nlit);
+	op += nlit;
+
+	if (mlen == 0) {
+		return op;
+	}
+	if (max - op < 2) {
+		return max + 1;
+	}
+	dst[op++] = dist & 0xff;
+	dst[op++] = dist >> 8;
+	if (mcode >= 15) {
+		op = lz_putlen(dst, op, max, mcode - 15);
+	}
+	return op;
+}
+
+size_t
+lz_compress(const void *src, size_t len, void *dst, size_t max,
+	    uint16_t *table)
+{
+	const uint8_t *in = src;
+	uint8_t *out = dst;
+	size_t ip, anchor, op, ref, mlen;
+	uint32_t v;
+	unsigned h;
+
+	KASSERT(len < 65536);
+
+	for (h=0; h<LZ_TABLESIZE; h++) {
+		table[h] = 0;
+	}
+
+	ip = anchor = op = 0;
+	while (ip + LZ_MINMATCH <= len) {
+		v = lz_read32(in + ip);
+		h = lz_hash(v);
+		ref = table[h];
+		table[h] = ip + 1;
+		if (ref == 0 || lz_read32(in + ref - 1) != v) {
+			ip++;
+			continue;
+		}
+		ref--;
+
+		mlen = LZ_MINMATCH;
+		while (ip + mlen < len && in[ref + mlen] == in[ip + mlen]) {
+			mlen++;
+		}
+		op = lz_putseq(out, op, max, in + anchor, ip - anchor,
+			       ip - ref, mlen);
+		if (op > max) {
+			return 0;
+		}
+		ip += mlen;
+		anchor = ip;
+	}
+
+	op = lz_putseq(out, op, max, in + anchor, len - anchor, 0, 0);
+	if (op > max) {
+		return 0;
+	}
+	return op;
+}
+
+/*
+ * Read a length continued past a nibble of 15. Returns false if the
+ * input runs out first.
+ */
+static
+bool
+lz_getlen(const uint8_t *src, size_t *ip, size_t srclen, size_t *n)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= srclen) {
+			return false;
+		}
+		b = src[(*ip)++];
+		*n += b;
+	} while (b == 255);
+	return true;
+}
+
+int
+lz_decompress(const void *src, size_t srclen, void *dst, size_t dstlen)
+{
+	const uint8_t *in = src;
+	uint8_t *out = dst;
+	size_t ip, op, nlit, dist, mlen, i;
+	uint8_t token;
+
+	ip = op = 0;
+	while (ip < srclen) {
+		token = in[ip++];
+
+		nlit = token >> 4;
+		if (nlit == 15 && !lz_getlen(in, &ip, srclen, &nlit)) {
+			return EINVAL;
+		}
+		if (nlit > srclen - ip || nlit > dstlen - op) {
+			return EINVAL;
+		}
+		memcpy(out + op, in + ip, nlit);
+		ip += nlit;
+		op += nlit;
+
+		if (ip == srclen) {
+			/* The last sequence has no match. */
+			break;
+		}
+
+		if (srclen - ip < 2) {
+			return EINVAL;
+		}
+		dist = in[ip] | (in[ip + 1] << 8);
+		ip += 2;
+		mlen = (token & 15) + LZ_MINMATCH;
+		if ((token & 15) == 15 && !lz_getlen(in, &ip, srclen, &mlen)) {
+			return EINVAL;
+		}
+		if (dist == 0 || dist > op || mlen > dstlen - op) {
+			return EINVAL;
+		}
+		/* The match may overlap what it's copying; go bytewise. */
+		for (i=0; i<mlen; i++) {
+			out[op + i] = out[op - dist + i];
+		}
+		op += mlen;
+	}
+
+	return op == dstlen ? 0 : EINVAL;
+}
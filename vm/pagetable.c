@@ -0,0 +1,96 @@
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <pagetable.h>
+
+/*
+ * Two-level page table. See pagetable.h.
+ *
+ * Both levels are exactly one page, so they come straight from the
+ * page allocator via kmalloc and never fragment the subpage pools.
+ */
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	COMPILE_ASSERT(sizeof(struct pagetable) == PAGE_SIZE);
+
+	pt = kmalloc(sizeof(struct pagetable));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_L1_ENTRIES; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i;
+
+	KASSERT(pt != NULL);
+
+	for (i=0; i<PT_L1_ENTRIES; i++) {
+		if (pt->pt_dir[i] != NULL) {
+			kfree(pt->pt_dir[i]);
+		}
+	}
+	kfree(pt);
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	pte_t *l2;
+	unsigned i;
+
+	KASSERT(pt != NULL);
+
+	l2 = pt->pt_dir[PT_L1_INDEX(vaddr)];
+	if (l2 == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		l2 = kmalloc(PT_L2_ENTRIES * sizeof(pte_t));
+		if (l2 == NULL) {
+			return NULL;
+		}
+		for (i=0; i<PT_L2_ENTRIES; i++) {
+			l2[i] = 0;
+		}
+		pt->pt_dir[PT_L1_INDEX(vaddr)] = l2;
+	}
+	return &l2[PT_L2_INDEX(vaddr)];
+}
+
+int
+pt_walk(struct pagetable *pt,
+	int (*func)(void *data, vaddr_t vaddr, pte_t *pte), void *data)
+{
+	unsigned i, j;
+	pte_t *l2;
+	int result;
+
+	for (i=0; i<PT_L1_ENTRIES; i++) {
+		l2 = pt->pt_dir[i];
+		if (l2 == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_L2_ENTRIES; j++) {
+			if (l2[j] == 0) {
+				continue;
+			}
+			result = func(data, (vaddr_t)((i << 22) | (j << 12)),
+				      &l2[j]);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,247 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <sharedtext.h>
+
+/*
+ * The table of shared objects. There are only ever a handful (two or
+ * so per distinct running program, plus files mapped MAP_SHARED), so
+ * a list does fine.
+ */
+static struct lock *sharedtext_lock;
+static struct sharedtext *sharedtext_list;	/* protected by the lock */
+
+void
+sharedtext_bootstrap(void)
+{
+	sharedtext_lock = lock_create("sharedtext");
+	if (sharedtext_lock == NULL) {
+		panic("sharedtext: cannot create lock\n");
+	}
+	sharedtext_list = NULL;
+}
+
+/*
+ * Find the object matching the arguments, or make one.
+ */
+static
+struct sharedtext *
+sharedtext_lookup(struct vnode *v, bool file, off_t offset, vaddr_t fileva,
+		  size_t filesz)
+{
+	struct sharedtext *st;
+
+	lock_acquire(sharedtext_lock);
+
+	for (st = sharedtext_list; st != NULL; st = st->st_next) {
+		if (st->st_vnode != v || st->st_file != file) {
+			continue;
+		}
+		if (file || (st->st_offset == offset &&
+			     st->st_fileva == fileva &&
+			     st->st_filesz == filesz)) {
+			st->st_refcount++;
+			lock_release(sharedtext_lock);
+			return st;
+		}
+	}
+
+	st = kmalloc(sizeof(struct sharedtext));
+	if (st == NULL) {
+		lock_release(sharedtext_lock);
+		return NULL;
+	}
+	st->st_lock = lock_create("sharedtext segment");
+	if (st->st_lock == NULL) {
+		kfree(st);
+		lock_release(sharedtext_lock);
+		return NULL;
+	}
+	st->st_pt = pt_create();
+	if (st->st_pt == NULL) {
+		lock_destroy(st->st_lock);
+		kfree(st);
+		lock_release(sharedtext_lock);
+		return NULL;
+	}
+
+	VOP_INCREF(v);
+	st->st_vnode = v;
+	st->st_offset = offset;
+	st->st_fileva = fileva;
+	st->st_filesz = filesz;
+	st->st_file = file;
+	st->st_refcount = 1;
+	st->st_next = sharedtext_list;
+	sharedtext_list = st;
+
+	lock_release(sharedtext_lock);
+	return st;
+}
+
+struct sharedtext *
+sharedtext_get(struct vnode *v, off_t offset, vaddr_t fileva, size_t filesz)
+{
+	return sharedtext_lookup(v, false, offset, fileva, filesz);
+}
+
+struct sharedtext *
+sharedtext_getfile(struct vnode *v)
+{
+	struct sharedtext *st;
+	struct stat statbuf;
+
+	/*
+	 * Pages past the end of the file as it is now read as zeros
+	 * and are never written back. The file may have changed size
+	 * since it was last mapped, so each new mapping brings the
+	 * object's idea of it up to date.
+	 */
+	if (VOP_STAT(v, &statbuf)) {
+		return NULL;
+	}
+	st = sharedtext_lookup(v, true, 0, 0, statbuf.st_size);
+	if (st != NULL) {
+		lock_acquire(st->st_lock);
+		st->st_filesz = statbuf.st_size;
+		lock_release(st->st_lock);
+	}
+	return st;
+}
+
+void
+sharedtext_incref(struct sharedtext *st)
+{
+	lock_acquire(sharedtext_lock);
+	KASSERT(st->st_refcount > 0);
+	st->st_refcount++;
+	lock_release(sharedtext_lock);
+}
+
+/*
+ * Write one modified page back to the file. Used with pt_walk.
+ */
+static
+int
+sharedtext_syncpage(void *data, vaddr_t key, pte_t *pte)
+{
+	struct sharedtext *st = data;
+	struct iovec iov;
+	struct uio u;
+	size_t len;
+	int result;
+
+	if ((*pte & PTE_MODIFIED) == 0 || key >= st->st_filesz) {
+		return 0;
+	}
+
+	len = st->st_filesz - key;
+	if (len > PAGE_SIZE) {
+		len = PAGE_SIZE;
+	}
+
+	uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(*pte & PTE_FRAME), len,
+		  key, UIO_WRITE);
+	result = VOP_WRITE(st->st_vnode, &u);
+	if (result) {
+		return result;
+	}
+	return u.uio_resid == 0 ? 0 : EIO;
+}
+
+int
+sharedtext_sync(struct sharedtext *st)
+{
+	int result;
+
+	KASSERT(st->st_file);
+
+	lock_acquire(st->st_lock);
+	result = pt_walk(st->st_pt, sharedtext_syncpage, st);
+	lock_release(st->st_lock);
+	return result;
+}
+
+int
+sharedtext_syncfile(struct vnode *v)
+{
+	struct sharedtext *st;
+	int result;
+
+	lock_acquire(sharedtext_lock);
+	for (st = sharedtext_list; st != NULL; st = st->st_next) {
+		if (st->st_vnode == v && st->st_file) {
+			break;
+		}
+	}
+	if (st == NULL) {
+		lock_release(sharedtext_lock);
+		return 0;
+	}
+	st->st_refcount++;
+	lock_release(sharedtext_lock);
+
+	result = sharedtext_sync(st);
+	sharedtext_put(st);
+	return result;
+}
+
+/*
+ * Drop the object's reference to the frame behind one PTE. Used with
+ * pt_walk.
+ */
+static
+int
+sharedtext_freepage(void *data, vaddr_t key, pte_t *pte)
+{
+	(void)data;
+	(void)key;
+
+	/* These frames are never paged out, so no need to pin. */
+	KASSERT(*pte & PTE_VALID);
+	coremap_decref(*pte & PTE_FRAME);
+	*pte = 0;
+	return 0;
+}
+
+void
+sharedtext_put(struct sharedtext *st)
+{
+	struct sharedtext **prev;
+	int result;
+
+	lock_acquire(sharedtext_lock);
+	KASSERT(st->st_refcount > 0);
+	st->st_refcount--;
+	if (st->st_refcount > 0) {
+		lock_release(sharedtext_lock);
+		return;
+	}
+
+	for (prev = &sharedtext_list; *prev != st; prev = &(*prev)->st_next) {
+		KASSERT(*prev != NULL);
+	}
+	*prev = st->st_next;
+	lock_release(sharedtext_lock);
+
+	if (st->st_file) {
+		result = sharedtext_sync(st);
+		if (result) {
+			kprintf("sharedtext: writeback failed: %s\n",
+				strerror(result));
+		}
+	}
+
+	pt_walk(st->st_pt, sharedtext_freepage, NULL);
+	pt_destroy(st->st_pt);
+	lock_destroy(st->st_lock);
+	VOP_DECREF(st->st_vnode);
+	kfree(st);
+}
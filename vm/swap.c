@@ -0,0 +1,445 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <swap.h>
+#include <lzpage.h>
+#include <uw-vmstats.h>
+
+/*
+ * Swap space on a raw disk.
+ *
+ * Slot N lives at byte offset N * PAGE_SIZE on the disk. Slots are
+ * handed out from a bitmap; a slot belongs to exactly one PTE, and is
+ * released when its address space goes away. A page read back in
+ * keeps its slot until it is first written (see coremap_setclean), so
+ * that if it is paged out again unchanged it needn't be rewritten.
+ *
+ * In front of the disk is a pool of RAM holding pages compressed with
+ * lz_compress. Pages are put there if they compress well enough and
+ * there's room, and go to the disk otherwise; either way they get a
+ * slot number, which is how the PTE finds them. The pool is cut into
+ * SWAP_ZCHUNK-byte chunks, and a compressed page is a chain of them,
+ * so it never needs compacting. Compressing and expanding go through
+ * one workspace, under swap_zlock.
+ */
+
+/* RAM for compressed pages: 1/SWAP_ZPOOLDIV of free memory, capped */
+#define SWAP_ZPOOLDIV    16
+#define SWAP_ZPOOLPAGES  64
+#define SWAP_ZCHUNK      256
+#define SWAP_ZMAXCHUNKS  (SWAP_ZPOOLPAGES * PAGE_SIZE / SWAP_ZCHUNK)
+#define SWAP_ZNONE       0xffff		/* ends a chunk chain */
+
+/* Pages that don't compress to this size go straight to disk. */
+#define SWAP_ZMAXLEN     (PAGE_SIZE * 3 / 4)
+
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+static struct vnode *swap_vnode;	/* NULL if there's no swap */
+static struct bitmap *swap_map;		/* protected by swap_lock */
+static unsigned swap_nslots;
+static unsigned swap_nused;		/* slots in use; swap_lock */
+
+/* The compressed pool; NULL if there isn't one */
+static char *swap_zpool;
+static unsigned swap_znchunks;
+static uint16_t swap_znext[SWAP_ZMAXCHUNKS];	/* next in chain; swap_lock */
+static unsigned swap_zfree;			/* free chunks; swap_lock */
+static unsigned swap_znfree;			/* ...and how many */
+static uint16_t *swap_zhead;	/* first chunk of each slot, or SWAP_ZNONE */
+static uint16_t *swap_zlen;	/* ...and its compressed length */
+
+/* Workspace, under swap_zlock */
+static struct lock *swap_zlock;
+static uint16_t swap_ztable[LZ_TABLESIZE];
+static uint8_t swap_zbuf[PAGE_SIZE];
+
+/* Counters for swap_printstats, under swap_lock */
+static unsigned swap_zstores;		/* pages put in the pool */
+static unsigned swap_zrejects;		/* ...not, for not compressing */
+static unsigned swap_zfulls;		/* ...not, for lack of room */
+static unsigned swap_zhits;		/* pages read back from the pool */
+static unsigned swap_zmisses;		/* ...and from disk */
+static uint64_t swap_zbytesin;		/* bytes compressed */
+static uint64_t swap_zbytesout;		/* ...and what they came to */
+
+/*
+ * Set up the compressed pool. If there isn't memory for it, we just do
+ * without.
+ */
+static
+void
+swap_zbootstrap(void)
+{
+	unsigned i, npages;
+
+	npages = coremap_freecount() / SWAP_ZPOOLDIV;
+	if (npages > SWAP_ZPOOLPAGES) {
+		npages = SWAP_ZPOOLPAGES;
+	}
+	if (npages == 0) {
+		return;
+	}
+	swap_znchunks = npages * PAGE_SIZE / SWAP_ZCHUNK;
+
+	swap_zlock = lock_create("swapz");
+	swap_zhead = kmalloc(swap_nslots * sizeof(swap_zhead[0]));
+	swap_zlen = kmalloc(swap_nslots * sizeof(swap_zlen[0]));
+	swap_zpool = kmalloc(npages * PAGE_SIZE);
+	if (swap_zlock == NULL || swap_zhead == NULL || swap_zlen == NULL ||
+	    swap_zpool == NULL) {
+		kprintf("swap: no memory for compressed pool\n");
+		if (swap_zlock != NULL) {
+			lock_destroy(swap_zlock);
+		}
+		kfree(swap_zhead);
+		kfree(swap_zlen);
+		kfree(swap_zpool);
+		swap_zpool = NULL;
+		return;
+	}
+
+	for (i=0; i<swap_nslots; i++) {
+		swap_zhead[i] = SWAP_ZNONE;
+	}
+	for (i=0; i<swap_znchunks; i++) {
+		swap_znext[i] = i + 1 < swap_znchunks ? i + 1 : SWAP_ZNONE;
+	}
+	swap_zfree = 0;
+	swap_znfree = swap_znchunks;
+
+	kprintf("swap: %uk compressed pool\n", npages * (PAGE_SIZE / 1024));
+}
+
+void
+swap_bootstrap(void)
+{
+	struct stat st;
+	char path[sizeof(SWAP_DEVICE)];
+	int result;
+
+	/* vfs_open destroys the pathname it's given. */
+	strcpy(path, SWAP_DEVICE);
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s; running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: %s: stat: %s\n", SWAP_DEVICE, strerror(result));
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	if (swap_nslots > PTE_SWAPSLOT_MAX) {
+		swap_nslots = PTE_SWAPSLOT_MAX;
+	}
+	if (swap_nslots == 0) {
+		kprintf("swap: %s is too small; running without swap\n",
+			SWAP_DEVICE);
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		return;
+	}
+
+	swap_map = bitmap_create(swap_nslots);
+	if (swap_map == NULL) {
+		panic("swap: cannot allocate slot bitmap\n");
+	}
+
+	kprintf("swap: %s, %u pages (%uk)\n", SWAP_DEVICE, swap_nslots,
+		swap_nslots * (PAGE_SIZE / 1024));
+
+	swap_zbootstrap();
+}
+
+bool
+swap_enabled(void)
+{
+	return swap_vnode != NULL;
+}
+
+/*
+ * Move one page between SLOT and frame PADDR.
+ */
+static
+int
+swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &u);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &u);
+	}
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		kprintf("swap: short %s at slot %u\n",
+			rw == UIO_READ ? "read" : "write", slot);
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Try to put frame PADDR in the compressed pool as SLOT. Returns false
+ * if it doesn't compress well enough or there's no room.
+ */
+static
+bool
+swap_zstore(unsigned slot, paddr_t paddr)
+{
+	unsigned nchunks, chunk, i;
+	size_t len;
+
+	if (swap_zpool == NULL) {
+		return false;
+	}
+
+	lock_acquire(swap_zlock);
+	len = lz_compress((const void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+			  swap_zbuf, SWAP_ZMAXLEN, swap_ztable);
+
+	spinlock_acquire(&swap_lock);
+	if (len == 0) {
+		swap_zrejects++;
+		spinlock_release(&swap_lock);
+		lock_release(swap_zlock);
+		return false;
+	}
+	nchunks = DIVROUNDUP(len, SWAP_ZCHUNK);
+	if (nchunks > swap_znfree) {
+		swap_zfulls++;
+		spinlock_release(&swap_lock);
+		lock_release(swap_zlock);
+		return false;
+	}
+
+	/* Take the first NCHUNKS off the free list. */
+	swap_zhead[slot] = swap_zfree;
+	swap_zlen[slot] = len;
+	chunk = swap_zfree;
+	for (i=1; i<nchunks; i++) {
+		chunk = swap_znext[chunk];
+	}
+	swap_zfree = swap_znext[chunk];
+	swap_znext[chunk] = SWAP_ZNONE;
+	swap_znfree -= nchunks;
+
+	swap_zstores++;
+	swap_zbytesin += PAGE_SIZE;
+	swap_zbytesout += len;
+	spinlock_release(&swap_lock);
+
+	/* The chain is ours now, and only we follow it. */
+	chunk = swap_zhead[slot];
+	for (i=0; i<len; i+=SWAP_ZCHUNK) {
+		memcpy(swap_zpool + chunk * SWAP_ZCHUNK, swap_zbuf + i,
+		       len - i < SWAP_ZCHUNK ? len - i : SWAP_ZCHUNK);
+		chunk = swap_znext[chunk];
+	}
+	lock_release(swap_zlock);
+	return true;
+}
+
+/*
+ * Read SLOT into frame PADDR from the compressed pool. Returns false
+ * if it's on disk instead.
+ */
+static
+bool
+swap_zload(unsigned slot, paddr_t paddr)
+{
+	unsigned chunk, i, len;
+	int result;
+
+	/* Only the slot's owner reads or frees its chain. */
+	if (swap_zpool == NULL || swap_zhead[slot] == SWAP_ZNONE) {
+		spinlock_acquire(&swap_lock);
+		swap_zmisses++;
+		spinlock_release(&swap_lock);
+		return false;
+	}
+
+	lock_acquire(swap_zlock);
+	len = swap_zlen[slot];
+	chunk = swap_zhead[slot];
+	for (i=0; i<len; i+=SWAP_ZCHUNK) {
+		memcpy(swap_zbuf + i, swap_zpool + chunk * SWAP_ZCHUNK,
+		       len - i < SWAP_ZCHUNK ? len - i : SWAP_ZCHUNK);
+		chunk = swap_znext[chunk];
+	}
+	result = lz_decompress(swap_zbuf, len,
+			       (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+	if (result) {
+		panic("swap: compressed slot %u is damaged\n", slot);
+	}
+	lock_release(swap_zlock);
+
+	spinlock_acquire(&swap_lock);
+	swap_zhits++;
+	spinlock_release(&swap_lock);
+	return true;
+}
+
+int
+swap_pageout(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
+{
+	pte_t *pte;
+	unsigned slot;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	KASSERT(pte != NULL);
+	KASSERT((*pte & (PTE_FRAME | PTE_VALID)) == (paddr | PTE_VALID));
+
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc(swap_map, &slot);
+	if (result == 0) {
+		swap_nused++;
+	}
+	spinlock_release(&swap_lock);
+	if (result) {
+		return ENOSPC;
+	}
+
+	/* The page mustn't be written behind our back while we copy it. */
+	*pte |= PTE_NOREFILL;
+	vm_tlb_revoke(&as->as_tlb, vaddr);
+
+	if (swap_zstore(slot, paddr)) {
+		vmstats_inc(VMSTAT_ZSWAP_STORE);
+	}
+	else {
+		result = swap_io(slot, paddr, UIO_WRITE);
+		if (result) {
+			swap_discard(slot);
+			return result;
+		}
+		vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	}
+
+	*pte = PTE_SWAPPTE(slot);
+	return 0;
+}
+
+void
+swap_pageclean(struct addrspace *as, vaddr_t vaddr, paddr_t paddr,
+	       unsigned slot)
+{
+	pte_t *pte;
+
+	KASSERT(swap_vnode != NULL);
+
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	KASSERT(pte != NULL);
+	KASSERT((*pte & (PTE_FRAME | PTE_VALID | PTE_WRITE)) ==
+		(paddr | PTE_VALID));
+
+	*pte |= PTE_NOREFILL;
+	vm_tlb_revoke(&as->as_tlb, vaddr);
+	*pte = PTE_SWAPPTE(slot);
+}
+
+int
+swap_pagein(unsigned slot, paddr_t paddr, bool *fromdisk)
+{
+	KASSERT(swap_vnode != NULL);
+	if (swap_zload(slot, paddr)) {
+		*fromdisk = false;
+		return 0;
+	}
+	*fromdisk = true;
+	return swap_io(slot, paddr, UIO_READ);
+}
+
+void
+swap_discard(unsigned slot)
+{
+	unsigned chunk, n;
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	swap_nused--;
+
+	if (swap_zpool != NULL && swap_zhead[slot] != SWAP_ZNONE) {
+		/* Put its chain back on the front of the free list. */
+		chunk = swap_zhead[slot];
+		for (n=1; swap_znext[chunk] != SWAP_ZNONE; n++) {
+			chunk = swap_znext[chunk];
+		}
+		swap_znext[chunk] = swap_zfree;
+		swap_zfree = swap_zhead[slot];
+		swap_znfree += n;
+		swap_zhead[slot] = SWAP_ZNONE;
+	}
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_printstats(void)
+{
+	unsigned nused, stores, rejects, fulls, hits, misses, nfree;
+	uint64_t bytesin, bytesout;
+
+	if (swap_vnode == NULL) {
+		kprintf("swap: none\n");
+		return;
+	}
+
+	spinlock_acquire(&swap_lock);
+	nused = swap_nused;
+	stores = swap_zstores;
+	rejects = swap_zrejects;
+	fulls = swap_zfulls;
+	hits = swap_zhits;
+	misses = swap_zmisses;
+	nfree = swap_znfree;
+	bytesin = swap_zbytesin;
+	bytesout = swap_zbytesout;
+	spinlock_release(&swap_lock);
+
+	kprintf("swap: %u slots, %u in use\n", swap_nslots, nused);
+	if (swap_zpool == NULL) {
+		kprintf("swap: no compressed pool\n");
+		return;
+	}
+	kprintf("compressed pool: %u of %u chunks free\n", nfree,
+		swap_znchunks);
+	kprintf("  %u stored, %u didn't compress, %u found it full\n",
+		stores, rejects, fulls);
+	kprintf("  ratio %u.%02u:1 (%llu bytes to %llu)\n",
+		bytesout ? (unsigned)(bytesin / bytesout) : 0,
+		bytesout ? (unsigned)(bytesin * 100 / bytesout % 100) : 0,
+		bytesin, bytesout);
+	kprintf("  page-ins: %u hits, %u from disk (%u%% hit rate)\n",
+		hits, misses,
+		hits + misses ? hits * 100 / (hits + misses) : 0);
+}
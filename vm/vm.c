@@ -0,0 +1,562 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <vnode.h>
+#include <synch.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <sharedtext.h>
+#include <swap.h>
+#include <uw-vmstats.h>
+
+/*
+ * Machine-independent part of the VM system: page fault handling and
+ * the kernel page allocator interface.
+ *
+ * User pages are allocated lazily. An address space starts out with
+ * nothing but its region list; the first touch of each page lands in
+ * vm_fault, which gives it a frame (read from the executable, or
+ * zero-filled) and records it in the page table. Read-only parts of
+ * the executable are shared between processes (see sharedtext.c), as
+ * are pages of files mapped MAP_SHARED. Later TLB misses on the same
+ * page just reload the translation from the page table.
+ *
+ * When memory runs low, the page daemon pages something out to swap
+ * (see coremap.c and swap.c) and the PTE records the swap slot; the
+ * next fault on that page reads it back in. The page comes back
+ * read-only and keeps its slot, so that if it isn't written before it
+ * is paged out again it needn't be written; the first write fault
+ * drops the slot.
+ */
+
+void
+vm_bootstrap(void)
+{
+	coremap_bootstrap();
+	sharedtext_bootstrap();
+	swap_bootstrap();
+	vmstats_init();
+	if (swap_enabled()) {
+		coremap_startdaemon();
+	}
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+
+	pa = coremap_alloc(npages);
+	if (pa == 0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	coremap_free(KVADDR_TO_PADDR(addr));
+}
+
+bool
+vm_idle(void)
+{
+	/* Top up the pool of pre-zeroed frames for vm_zerofill. */
+	return coremap_zeroidle();
+}
+
+int vm_faultaround = VM_FAULTAROUND_DEFAULT;
+
+/*
+ * Permission bits for pages in region RG.
+ */
+#define VM_RGPROT(rg)  (((rg)->rg_flags & RG_WRITE) ? PTE_WRITE : 0)
+
+/*
+ * Fill frame PA, to be mapped at VADDR, from FILESZ bytes of file V
+ * at OFFSET that belong at FILEVA. Whatever part of the page that
+ * data doesn't cover is zeroed. Sets *READP according to whether there
+ * was anything to read.
+ */
+static
+int
+vm_readfile(struct vnode *v, off_t offset, vaddr_t fileva, size_t filesz,
+	    vaddr_t vaddr, paddr_t pa, bool *readp)
+{
+	struct iovec iov;
+	struct uio u;
+	vaddr_t start, end;
+	char *kva;
+	int result;
+
+	kva = (char *)PADDR_TO_KVADDR(pa);
+	bzero(kva, PAGE_SIZE);
+
+	start = vaddr;
+	if (start < fileva) {
+		start = fileva;
+	}
+	end = vaddr + PAGE_SIZE;
+	if (end > fileva + filesz) {
+		end = fileva + filesz;
+	}
+	*readp = start < end;
+	if (!*readp) {
+		return 0;
+	}
+
+	uio_kinit(&iov, &u, kva + (start - vaddr), end - start,
+		  offset + (start - fileva), UIO_READ);
+	result = VOP_READ(v, &u);
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		/* short read; problem with executable? */
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+	return 0;
+}
+
+/*
+ * The functions below give the nonresident page VADDR (of AS, where
+ * needed), which is in region RG and described by PTE, a frame. Each
+ * returns with the new frame pinned.
+ */
+
+/*
+ * Back the page with a fresh zero-filled frame.
+ */
+static
+int
+vm_zerofill(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	    pte_t *pte)
+{
+	paddr_t pa;
+
+	pa = coremap_alloc_zupage(as, vaddr);
+	if (pa == 0) {
+		return ENOMEM;
+	}
+
+	*pte = pa | PTE_VALID | VM_RGPROT(rg);
+	vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+	return 0;
+}
+
+/*
+ * Back the page with a frame holding whatever part of the region's
+ * file data falls in that page. Pages with no file data in them are
+ * just zero-filled.
+ */
+static
+int
+vm_filefill(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	    pte_t *pte)
+{
+	paddr_t pa;
+	bool didread;
+	int result;
+
+	if (vaddr + PAGE_SIZE <= rg->rg_fileva ||
+	    vaddr >= rg->rg_fileva + rg->rg_filesz) {
+		return vm_zerofill(as, rg, vaddr, pte);
+	}
+
+	pa = coremap_alloc_upage(as, vaddr);
+	if (pa == 0) {
+		return ENOMEM;
+	}
+	result = vm_readfile(rg->rg_vnode, rg->rg_offset, rg->rg_fileva,
+			     rg->rg_filesz, vaddr, pa, &didread);
+	if (result) {
+		coremap_decref(pa);
+		return result;
+	}
+	KASSERT(didread);
+
+	*pte = pa | PTE_VALID | VM_RGPROT(rg);
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	vmstats_inc(VMSTAT_ELF_FILE_READ);
+	return 0;
+}
+
+/*
+ * Map the page to the frame shared by everyone running this program
+ * (or mapping this file), reading it in if nobody has touched it yet.
+ * A shared file page is only mapped writable once it has been marked
+ * modified; see vm_makewritable.
+ */
+static
+int
+vm_textfill(struct region *rg, vaddr_t vaddr, pte_t *pte)
+{
+	struct sharedtext *st = rg->rg_text;
+	vaddr_t key;
+	pte_t *stpte;
+	paddr_t pa;
+	bool didread;
+	int result;
+
+	key = rg->rg_textbase + (vaddr - rg->rg_base);
+
+	lock_acquire(st->st_lock);
+
+	stpte = pt_lookup(st->st_pt, key, true);
+	if (stpte == NULL) {
+		lock_release(st->st_lock);
+		return ENOMEM;
+	}
+
+	if (coremap_pin(stpte, NULL, 0)) {
+		/* Someone else already read it in. */
+		pa = *stpte & PTE_FRAME;
+		coremap_incref(pa);
+		vmstats_inc(VMSTAT_TLB_RELOAD);
+	}
+	else {
+		/* No owner: these frames are never paged out. */
+		pa = coremap_alloc_upage(NULL, vaddr);
+		if (pa == 0) {
+			lock_release(st->st_lock);
+			return ENOMEM;
+		}
+		result = vm_readfile(st->st_vnode, st->st_offset,
+				     st->st_fileva, st->st_filesz,
+				     key, pa, &didread);
+		if (result) {
+			coremap_decref(pa);
+			lock_release(st->st_lock);
+			return result;
+		}
+		*stpte = pa | PTE_VALID;
+		coremap_incref(pa);
+		if (didread) {
+			vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+			vmstats_inc(VMSTAT_ELF_FILE_READ);
+		}
+		else {
+			vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		}
+	}
+
+	*pte = pa | PTE_VALID;
+	if (*stpte & PTE_MODIFIED) {
+		*pte |= VM_RGPROT(rg);
+	}
+
+	lock_release(st->st_lock);
+	return 0;
+}
+
+/*
+ * Bring the page back in from swap. If it came off the disk it stays
+ * there too, until the page is written; a compressed copy is let go of
+ * at once, so pages that are in core don't hold on to pool space.
+ */
+static
+int
+vm_swapin(struct addrspace *as, vaddr_t vaddr, pte_t *pte)
+{
+	unsigned slot;
+	paddr_t pa;
+	bool fromdisk;
+	int result;
+
+	KASSERT(*pte & PTE_SWAPPED);
+	slot = PTE_SWAPSLOT(*pte);
+
+	pa = coremap_alloc_upage(as, vaddr);
+	if (pa == 0) {
+		return ENOMEM;
+	}
+	result = swap_pagein(slot, pa, &fromdisk);
+	if (result) {
+		coremap_decref(pa);
+		return result;
+	}
+	if (!fromdisk) {
+		*pte = pa | PTE_VALID;
+		swap_discard(slot);
+		vmstats_inc(VMSTAT_ZSWAP_HIT);
+		return 0;
+	}
+	coremap_setclean(pa, slot);
+
+	/* Read-only, so the first write lets go of the slot. */
+	*pte = pa | PTE_VALID;
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	vmstats_inc(VMSTAT_SWAP_FILE_READ);
+	return 0;
+}
+
+/*
+ * Make the copy-on-write page VADDR of AS, described by PTE, privately
+ * writable, copying the frame if anyone else still shares it, whether
+ * through fork or same-page merging. The
+ * frame must be pinned; on success, whatever frame PTE then refers to
+ * is.
+ */
+static
+int
+vm_copyonwrite(struct addrspace *as, vaddr_t vaddr, pte_t *pte)
+{
+	paddr_t oldpa, newpa;
+
+	KASSERT(*pte & PTE_VALID);
+	KASSERT(*pte & PTE_COW);
+
+	oldpa = *pte & PTE_FRAME;
+
+	/*
+	 * If we hold the only reference, the other sharers have all
+	 * made their own copies (or gone away) and the frame is ours.
+	 */
+	if (coremap_refcount(oldpa) == 1) {
+		coremap_setdirty(oldpa);
+		*pte = (*pte & ~PTE_COW) | PTE_WRITE;
+		return 0;
+	}
+
+	newpa = coremap_alloc_upage(as, vaddr);
+	if (newpa == 0) {
+		return ENOMEM;
+	}
+	memmove((void *)PADDR_TO_KVADDR(newpa),
+		(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+	if (coremap_ismerged(oldpa)) {
+		vmstats_inc(VMSTAT_KSM_SPLIT);
+	}
+
+	*pte = newpa | (*pte & ~(PTE_FRAME | PTE_COW)) | PTE_WRITE;
+	coremap_unpin(oldpa);
+	coremap_decref(oldpa);
+	return 0;
+}
+
+/*
+ * Let the page VADDR of AS, in writable region RG and described by
+ * PTE, be written: copy it if it is copy-on-write, mark it modified if
+ * it belongs to a shared file mapping, or else let go of the copy on
+ * swap it was read in from. The frame must be pinned; on success,
+ * whatever frame PTE then refers to is.
+ */
+static
+int
+vm_makewritable(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+		pte_t *pte)
+{
+	struct sharedtext *st = rg->rg_text;
+	pte_t *stpte;
+
+	KASSERT(rg->rg_flags & RG_WRITE);
+
+	if (*pte & PTE_COW) {
+		return vm_copyonwrite(as, vaddr, pte);
+	}
+	if (st == NULL) {
+		/* Private pages are only shared copy-on-write. */
+		KASSERT(coremap_refcount(*pte & PTE_FRAME) == 1);
+		coremap_setdirty(*pte & PTE_FRAME);
+		*pte |= PTE_WRITE;
+		return 0;
+	}
+
+	lock_acquire(st->st_lock);
+	stpte = pt_lookup(st->st_pt, rg->rg_textbase + (vaddr - rg->rg_base),
+			  false);
+	KASSERT(stpte != NULL);
+	KASSERT((*stpte & PTE_FRAME) == (*pte & PTE_FRAME));
+	*stpte |= PTE_MODIFIED;
+	lock_release(st->st_lock);
+
+	*pte |= PTE_WRITE;
+	return 0;
+}
+
+/*
+ * Load TLB entries for the resident pages of RG near FAULTADDRESS, in
+ * the aligned window of vm_faultaround pages that holds it, so that a
+ * process running through memory doesn't miss on every page. Each
+ * frame is pinned only while its entry is loaded, as usual; frames
+ * someone else has pinned are skipped rather than waited for, and so
+ * are pages the clock hand is watching for a real use. Loading an
+ * entry doesn't mark the frame recently used (see coremap_preloadpin),
+ * so that only real references keep it from the clock hand.
+ */
+static
+void
+vm_preloadaround(struct addrspace *as, struct region *rg,
+		 vaddr_t faultaddress)
+{
+	vaddr_t start, end, rgend, va;
+	unsigned width;
+	pte_t *pte;
+
+	width = vm_faultaround;
+	if (width <= 1) {
+		return;
+	}
+	if (width > VM_FAULTAROUND_MAX) {
+		width = VM_FAULTAROUND_MAX;
+	}
+
+	start = faultaddress - ((faultaddress / PAGE_SIZE) % width) * PAGE_SIZE;
+	end = start + width * PAGE_SIZE;
+	rgend = rg->rg_base + rg->rg_npages * PAGE_SIZE;
+	if (start < rg->rg_base) {
+		start = rg->rg_base;
+	}
+	if (end > rgend || end < start) {
+		end = rgend;
+	}
+
+	for (va = start; va < end; va += PAGE_SIZE) {
+		if (va == faultaddress) {
+			continue;
+		}
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL || !coremap_preloadpin(pte, as, va)) {
+			continue;
+		}
+		vm_tlb_preload(va, *pte);
+		coremap_unpin(*pte & PTE_FRAME);
+	}
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct region *rg;
+	pte_t *pte;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	rg = as_findregion(as, faultaddress);
+	if (rg == NULL) {
+		return EFAULT;
+	}
+	if ((rg->rg_flags & (RG_READ | RG_WRITE | RG_EXEC)) == 0) {
+		/* stack guard page, or mmap with PROT_NONE */
+		return EFAULT;
+	}
+
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+
+	if (faulttype == VM_FAULT_READONLY) {
+		/*
+		 * A write hit a TLB entry without write permission.
+		 * In a writable region, the page is copy-on-write, an
+		 * unmodified shared file page, or clean from swap.
+		 */
+		if (!coremap_pin(pte, as, faultaddress)) {
+			/*
+			 * Paged out since the entry was loaded, which
+			 * removed it; the retry will take a TLB miss.
+			 */
+			return 0;
+		}
+		if ((rg->rg_flags & RG_WRITE) == 0) {
+			coremap_unpin(*pte & PTE_FRAME);
+			return EFAULT;
+		}
+		result = vm_makewritable(as, rg, faultaddress, pte);
+		if (result) {
+			coremap_unpin(*pte & PTE_FRAME);
+			return result;
+		}
+		/* This replaces the stale read-only entry. */
+		vm_tlb_load(faultaddress, *pte);
+		coremap_unpin(*pte & PTE_FRAME);
+		return 0;
+	}
+
+	if (faulttype == VM_FAULT_WRITE && (rg->rg_flags & RG_WRITE) == 0) {
+		return EFAULT;
+	}
+
+	vmstats_inc(VMSTAT_TLB_FAULT);
+
+	/*
+	 * Only this thread changes a nonresident PTE, so if the pin
+	 * fails, *pte stays as we see it.
+	 */
+	if (coremap_pin(pte, as, faultaddress)) {
+		vmstats_inc(VMSTAT_TLB_RELOAD);
+	}
+	else {
+		if (*pte & PTE_SWAPPED) {
+			result = vm_swapin(as, faultaddress, pte);
+		}
+		else if (rg->rg_text != NULL) {
+			result = vm_textfill(rg, faultaddress, pte);
+		}
+		else if (rg->rg_vnode != NULL) {
+			result = vm_filefill(as, rg, faultaddress, pte);
+		}
+		else {
+			result = vm_zerofill(as, rg, faultaddress, pte);
+		}
+		if (result) {
+			return result;
+		}
+	}
+
+	/* Don't bother loading a read-only entry we'd fault on again. */
+	if (faulttype == VM_FAULT_WRITE && (*pte & PTE_WRITE) == 0) {
+		result = vm_makewritable(as, rg, faultaddress, pte);
+		if (result) {
+			coremap_unpin(*pte & PTE_FRAME);
+			return result;
+		}
+	}
+
+	/* Load the entry before unpinning, so page-out will revoke it. */
+	vm_tlb_load(faultaddress, *pte);
+	coremap_unpin(*pte & PTE_FRAME);
+
+	vm_preloadaround(as, rg, faultaddress);
+	return 0;
+}